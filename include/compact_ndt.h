@@ -0,0 +1,133 @@
+#ifndef _COMPACT_NDT_H_
+#define _COMPACT_NDT_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+// 按cache line(64字节)对齐的分配器,体素数组和哈希索引都用它分配
+template <typename T>
+struct CacheAlignedAllocator {
+    typedef T value_type;
+    static const std::size_t kAlignment = 64;
+
+    CacheAlignedAllocator() {}
+    template <typename U> CacheAlignedAllocator(const CacheAlignedAllocator<U> &) {}
+
+    T *allocate(std::size_t n) {
+        void *p = nullptr;
+        if (posix_memalign(&p, kAlignment, n * sizeof(T)) != 0) throw std::bad_alloc();
+        return static_cast<T *>(p);
+    }
+    void deallocate(T *p, std::size_t) { free(p); }
+
+    template <typename U> struct rebind { typedef CacheAlignedAllocator<U> other; };
+};
+
+template <typename T, typename U>
+bool operator==(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) { return false; }
+
+// 紧凑的NDT目标地图: 只保存每个体素的均值和打包的对称逆协方差(6个分量, float或half),
+// 不保留原始地图点云, 也不建立KD树, 体素通过开放寻址哈希表直接索引
+class CompactNdt{
+public:
+
+    enum Precision { FLOAT, HALF };
+
+    CompactNdt();
+
+    void setTransformationEpsilon(double epsilon) { trans_epsilon_ = epsilon; }
+    void setStepSize(double step_size) { step_size_ = step_size; }
+    void setResolution(float resolution) { resolution_ = resolution; }
+    void setMaximumIterations(int max_iterations) { max_iterations_ = max_iterations; }
+    void setPrecision(Precision precision) { precision_ = precision; }
+
+    double getTransformationEpsilon() const { return trans_epsilon_; }
+    double getStepSize() const { return step_size_; }
+    float getResolution() const { return resolution_; }
+    int getMaximumIterations() const { return max_iterations_; }
+    Precision getPrecision() const { return precision_; }
+
+    // 由地图点云构建体素, 构建完成后不再引用输入点云
+    void setInputTarget(const pcl::PointCloud<pcl::PointXYZ> &map);
+    bool hasTarget() const { return !voxel_means_.empty(); }
+
+    void setInputSource(const pcl::PointCloud<pcl::PointXYZ>::ConstPtr &source) { source_ = source; }
+    void align(pcl::PointCloud<pcl::PointXYZ> &output, const Eigen::Matrix4f &guess);
+
+    Eigen::Matrix4f getFinalTransformation() const { return final_transformation_; }
+    double getTransformationProbability() const { return trans_probability_; }
+    int getFinalNumIteration() const { return nr_iterations_; }
+
+    // 在给定位姿下计算一次得分、梯度和Hessian, 供ndt_benchmark测量单次迭代的开销
+    double evaluate(const Eigen::Matrix4f &transform, Eigen::Matrix<double, 6, 1> &gradient,
+                    Eigen::Matrix<double, 6, 6> &hessian) const {
+        return computeDerivatives(matrixToPose(transform), &gradient, &hessian);
+    }
+    // 点所在体素的序号, 没有体素时返回-1
+    int findVoxel(const Eigen::Vector3f &point) const;
+
+    std::size_t getVoxelNum() const { return voxel_means_.size() / 3; }
+    // 目标地图常驻内存的字节数
+    std::size_t getMemoryFootprint() const;
+
+private:
+
+    // 8字节的哈希槽: 体素序号 + 哈希值高32位, 完整的键由体素均值所在的栅格重新计算
+    struct IndexEntry {
+        uint32_t voxel;
+        uint32_t tag;
+    };
+
+    double trans_epsilon_;
+    double step_size_;
+    float resolution_;
+    int max_iterations_;
+    Precision precision_;
+    double outlier_ratio_;
+    double gauss_d1_, gauss_d2_;
+
+    // 每个体素占用: 均值3个float + 逆协方差6个float(或6个half加1个float缩放系数)
+    std::vector<float, CacheAlignedAllocator<float> > voxel_means_;
+    std::vector<float, CacheAlignedAllocator<float> > voxel_icov_f_;
+    std::vector<uint16_t, CacheAlignedAllocator<uint16_t> > voxel_icov_h_;
+    // half模式下每个体素逆协方差的缩放系数, 保证打包的分量落在[-1, 1]内
+    std::vector<float, CacheAlignedAllocator<float> > voxel_icov_scale_;
+    std::vector<IndexEntry, CacheAlignedAllocator<IndexEntry> > index_;
+    uint64_t index_mask_;
+
+    pcl::PointCloud<pcl::PointXYZ>::ConstPtr source_;
+    Eigen::Matrix4f final_transformation_;
+    double trans_probability_;
+    int nr_iterations_;
+
+    int64_t voxelKey(int ix, int iy, int iz) const;
+    int findVoxel(int64_t key) const;
+    int64_t meanVoxelKey(const float *mean) const;
+    void insertIndex(int64_t key, uint32_t voxel);
+    void loadVoxel(int voxel, Eigen::Vector3d &mean, Eigen::Matrix3d &icov) const;
+
+    double computeDerivatives(const Eigen::Matrix<double, 6, 1> &p,
+                              Eigen::Matrix<double, 6, 1> *gradient,
+                              Eigen::Matrix<double, 6, 6> *hessian) const;
+    static Eigen::Matrix4f poseToMatrix(const Eigen::Matrix<double, 6, 1> &p);
+    static Eigen::Matrix<double, 6, 1> matrixToPose(const Eigen::Matrix4f &m);
+
+    static uint16_t floatToHalf(float value);
+    static float halfToFloat(uint16_t value);
+
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+}; // CompactNdt
+
+#endif
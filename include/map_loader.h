@@ -4,29 +4,58 @@
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 #include <pcl/filters/voxel_grid.h>
+#include <pcl/io/pcd_io.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <ros/ros.h>
 #include <sensor_msgs/Imu.h>
 #include <sensor_msgs/PointCloud2.h>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <pcl_ros/transforms.h>
 
+#include "ndt_localizer/QueryMap.h"
+
 class MapLoader{
 public:
 
     ros::Publisher pc_map_pub_;
+    ros::Publisher map_view_pub_;
+    ros::ServiceServer query_map_srv_;
     std::vector<std::string> file_list_;
 
     MapLoader(ros::NodeHandle &nh);
+    ~MapLoader();
 
 private:
 
     float tf_x_, tf_y_, tf_z_, tf_roll_, tf_pitch_, tf_yaw_; 
 
+    // 变换后地图的导出, 默认关闭, 在后台线程中以压缩二进制pcd写出
+    bool save_map_;
+    std::string save_map_path_;
+    std::thread save_map_thread_;
+
+    // 二维瓦片索引: 地图点按所在瓦片排序存放, tile_index_记录每个瓦片在map_points_中的[起点, 终点)
+    // 只在提供query_map服务或发布地图概览时建立
+    double tile_size_;
+    pcl::PointCloud<pcl::PointXYZ> map_points_;
+    std::unordered_map<int64_t, std::pair<uint32_t, uint32_t>> tile_index_;
+    int min_tx_, min_ty_, max_tx_, max_ty_;
+
     void init_tf_params(ros::NodeHandle &nh);
     sensor_msgs::PointCloud2 CreatePcd();
     sensor_msgs::PointCloud2 TransformMap(sensor_msgs::PointCloud2 & in);
     void SaveMap(const pcl::PointCloud<pcl::PointXYZ>::Ptr map_pc_ptr);
+    void SaveMap(const sensor_msgs::PointCloud2 & map_msg);
+    void BuildTileIndex(sensor_msgs::PointCloud2 & map);
+    void CollectTile(const std::pair<uint32_t, uint32_t> & range, const ndt_localizer::QueryMap::Request & req,
+                     const double bounds[6], pcl::PointCloud<pcl::PointXYZ> & region) const;
+    void CollectRegion(const ndt_localizer::QueryMap::Request & req, pcl::PointCloud<pcl::PointXYZ> & region) const;
+    void PublishMapView(double resolution);
+    int TileCoord(double v) const;
+    int64_t TileKey(int tx, int ty) const;
+    bool QueryMap(ndt_localizer::QueryMap::Request & req, ndt_localizer::QueryMap::Response & res);
 }; //MapLoader
 
 #endif
\ No newline at end of file
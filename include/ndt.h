@@ -28,6 +28,9 @@
 #include <pcl_ros/point_cloud.h>
 #include <pcl_ros/transforms.h>
 
+#include "compact_ndt.h"
+#include "ndt_localizer/QueryMap.h"
+
 class NdtLocalizer{
 public:
 
@@ -40,6 +43,7 @@ private:
     ros::Subscriber initial_pose_sub_;
     ros::Subscriber map_points_sub_;
     ros::Subscriber sensor_points_sub_;
+    ros::ServiceClient query_map_client_;
 
     ros::Publisher sensor_aligned_pose_pub_;
     ros::Publisher ndt_pose_pub_;
@@ -49,6 +53,9 @@ private:
     ros::Publisher diagnostics_pub_;
 
     pcl::NormalDistributionsTransform<pcl::PointXYZ, pcl::PointXYZ> ndt_;
+    // ndt_target为"compact"时使用, 不保留原始地图点云
+    CompactNdt compact_ndt_;
+    bool use_compact_target_ = false;
 
     tf2_ros::Buffer tf2_buffer_;
     tf2_ros::TransformListener tf2_listener_;
@@ -66,6 +73,17 @@ private:
 
     std::mutex ndt_map_mtx_;
 
+    // use_map_query为true时通过map_loader的query_map服务获取当前位置周围map_radius内的地图,
+    // 车辆离上次查询中心超过map_update_distance时在后台线程中重新查询并重建ndt目标
+    bool use_map_query_ = false;
+    double map_radius_ = 150.0;
+    double map_update_distance_ = 30.0;
+    std::mutex map_query_mtx_;
+    Eigen::Vector3d map_query_position_;
+    bool has_map_query_position_ = false;
+    bool map_query_forced_ = false;
+    std::thread map_update_thread_;
+
     double converged_param_transform_probability_;
     std::thread diagnostic_thread_;
     std::map<std::string, std::string> key_value_stdmap_;
@@ -73,6 +91,9 @@ private:
     // function
     void init_params();
     void timer_diagnostic();
+    void timer_map_update();
+    void set_map_query_position(const Eigen::Vector3d & position, bool forced);
+    void update_target(pcl::PointCloud<pcl::PointXYZ>::Ptr map_points_ptr);
 
     bool get_transform(const std::string & target_frame, const std::string & source_frame,
                        const geometry_msgs::TransformStamped::Ptr & transform_stamped_ptr,
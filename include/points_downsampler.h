@@ -0,0 +1,199 @@
+#ifndef _POINTS_DOWNSAMPLER_H_
+#define _POINTS_DOWNSAMPLER_H_
+
+#include <ros/ros.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/point_cloud2_iterator.h>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/filters/voxel_grid.h>
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// voxel_grid_filter中的点云预处理, 单独放在头文件中便于ndt_benchmark复用
+
+#define MAX_MEASUREMENT_RANGE 120.0
+
+inline int64_t voxelKey(int ix, int iy, int iz)
+{
+  const int64_t mask = (int64_t(1) << 21) - 1;
+  const int64_t offset = int64_t(1) << 20;
+  return (((ix + offset) & mask) << 42) | (((iy + offset) & mask) << 21) | ((iz + offset) & mask);
+}
+
+inline pcl::PointCloud<pcl::PointXYZ> removePointsByRange(pcl::PointCloud<pcl::PointXYZ> scan, double min_range, double max_range)
+{
+  pcl::PointCloud<pcl::PointXYZ> narrowed_scan;
+  narrowed_scan.header = scan.header;
+
+  if( min_range>=max_range ) {
+    ROS_ERROR_ONCE("min_range>=max_range @(%lf, %lf)", min_range, max_range );
+    return scan;
+  }
+
+  double square_min_range = min_range * min_range;
+  double square_max_range = max_range * max_range;
+
+  for(pcl::PointCloud<pcl::PointXYZ>::const_iterator iter = scan.begin(); iter != scan.end(); ++iter)
+  {
+    const pcl::PointXYZ &p = *iter;
+    double square_distance = p.x * p.x + p.y * p.y;
+
+    if(square_min_range <= square_distance && square_distance <= square_max_range){
+      narrowed_scan.points.push_back(p);
+    }
+  }
+
+  return narrowed_scan;
+}
+
+//栅格地面分割: 每个栅格内离最低点不超过ground_height_threshold的点视为地面,
+//最低点高于ground_max_z的栅格(如车顶、树冠)不做处理
+inline void removeGround(pcl::PointCloud<pcl::PointXYZ> &scan, double ground_cell_size,
+                         double ground_height_threshold, double ground_max_z,
+                         std::vector<int> &point_cells, std::vector<float> &cell_min_z)
+{
+  const size_t n = scan.points.size();
+  if (n == 0 || !(ground_cell_size > 0)) return;
+
+  float min_x = scan.points[0].x, max_x = min_x, min_y = scan.points[0].y, max_y = min_y;
+  for (const auto &p : scan.points) {
+    min_x = std::min(min_x, p.x); max_x = std::max(max_x, p.x);
+    min_y = std::min(min_y, p.y); max_y = std::max(max_y, p.y);
+  }
+  const double inv_cell = 1.0 / ground_cell_size;
+  const int cols = static_cast<int>((max_x - min_x) * inv_cell) + 1;
+  const int rows = static_cast<int>((max_y - min_y) * inv_cell) + 1;
+
+  point_cells.resize(n);
+  cell_min_z.assign(static_cast<size_t>(cols) * rows, std::numeric_limits<float>::max());
+  for (size_t i = 0; i < n; ++i) {
+    const pcl::PointXYZ &p = scan.points[i];
+    const int cell = static_cast<int>((p.y - min_y) * inv_cell) * cols + static_cast<int>((p.x - min_x) * inv_cell);
+    point_cells[i] = cell;
+    cell_min_z[cell] = std::min(cell_min_z[cell], p.z);
+  }
+
+  size_t kept = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const pcl::PointXYZ &p = scan.points[i];
+    const float min_z = cell_min_z[point_cells[i]];
+    if (min_z <= ground_max_z && p.z - min_z <= ground_height_threshold) continue;
+    scan.points[kept++] = p;
+  }
+  scan.points.resize(kept);
+  scan.width = kept;
+  scan.height = 1;
+}
+
+// 静态占据栅格保存为排序去重后的栅格键数组, 每个栅格8字节, 查询用二分查找
+inline void sortVoxelKeys(std::vector<int64_t> &voxels)
+{
+  std::sort(voxels.begin(), voxels.end());
+  voxels.erase(std::unique(voxels.begin(), voxels.end()), voxels.end());
+}
+
+inline bool hasVoxel(const std::vector<int64_t> &voxels, int64_t key)
+{
+  return std::binary_search(voxels.begin(), voxels.end(), key);
+}
+
+//加入一个点所在的栅格, 数组增长到上次去重后的两倍时再排序去重, 构建时的内存与栅格数同量级而不是点数
+inline void addStaticMapPoint(float x, float y, float z, float inv_res, std::vector<int64_t> &voxels,
+                              size_t &compact_size)
+{
+  if (!std::isfinite(x) || !std::isfinite(y) || !std::isfinite(z)) return;
+  const int64_t key = voxelKey(static_cast<int>(std::floor(x * inv_res)),
+                               static_cast<int>(std::floor(y * inv_res)),
+                               static_cast<int>(std::floor(z * inv_res)));
+  // 地图中相邻的点大多落在同一栅格
+  if (!voxels.empty() && voxels.back() == key) return;
+  voxels.push_back(key);
+  if (voxels.size() >= compact_size) {
+    sortVoxelKeys(voxels);
+    compact_size = std::max(compact_size, 2 * voxels.size());
+  }
+}
+
+//由地图点云生成静态占据栅格
+inline void buildStaticMapVoxels(const pcl::PointCloud<pcl::PointXYZ> &map, double resolution,
+                                 std::vector<int64_t> &voxels)
+{
+  voxels.clear();
+  if (!(resolution > 0)) return;
+  const float inv_res = 1.0 / resolution;
+  size_t compact_size = 1 << 20;
+  for (const auto &p : map.points) addStaticMapPoint(p.x, p.y, p.z, inv_res, voxels, compact_size);
+  sortVoxelKeys(voxels);
+  voxels.shrink_to_fit();
+}
+
+//直接遍历地图消息, 不再转换出一份pcl点云
+inline void buildStaticMapVoxels(const sensor_msgs::PointCloud2 &map, double resolution,
+                                 std::vector<int64_t> &voxels)
+{
+  voxels.clear();
+  if (!(resolution > 0) || map.width * map.height == 0) return;
+  const float inv_res = 1.0 / resolution;
+  size_t compact_size = 1 << 20;
+  sensor_msgs::PointCloud2ConstIterator<float> iter_x(map, "x"), iter_y(map, "y"), iter_z(map, "z");
+  for (; iter_x != iter_x.end(); ++iter_x, ++iter_y, ++iter_z) {
+    addStaticMapPoint(*iter_x, *iter_y, *iter_z, inv_res, voxels, compact_size);
+  }
+  sortVoxelKeys(voxels);
+  voxels.shrink_to_fit();
+}
+
+//剔除经transform变换到map坐标系后不落在静态占据栅格(及其相邻栅格)内的点,
+//剩余点的比例低于min_keep_ratio时认为位姿不可信, 不做剔除并返回false
+inline bool removeUnmatchedPoints(pcl::PointCloud<pcl::PointXYZ> &scan, const Eigen::Affine3f &transform,
+                                  const std::vector<int64_t> &voxels, double resolution,
+                                  double min_keep_ratio, std::vector<uint8_t> &point_keep)
+{
+  if (!(resolution > 0)) return false;
+  const float inv_res = 1.0 / resolution;
+
+  const size_t n = scan.points.size();
+  point_keep.assign(n, 0);
+  for (size_t i = 0; i < n; ++i) {
+    const Eigen::Vector3f pm = transform * scan.points[i].getVector3fMap();
+    const int ix = static_cast<int>(std::floor(pm.x() * inv_res));
+    const int iy = static_cast<int>(std::floor(pm.y() * inv_res));
+    const int iz = static_cast<int>(std::floor(pm.z() * inv_res));
+    // 允许一个栅格的位姿误差
+    for (int dx = -1; dx <= 1 && !point_keep[i]; ++dx)
+      for (int dy = -1; dy <= 1 && !point_keep[i]; ++dy)
+        for (int dz = -1; dz <= 1 && !point_keep[i]; ++dz)
+          if (hasVoxel(voxels, voxelKey(ix + dx, iy + dy, iz + dz))) point_keep[i] = 1;
+  }
+
+  size_t matched = 0;
+  for (size_t i = 0; i < n; ++i) matched += point_keep[i];
+  if (matched < min_keep_ratio * n) return false;
+
+  size_t kept = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (point_keep[i]) scan.points[kept++] = scan.points[i];
+  }
+  scan.points.resize(kept);
+  scan.width = kept;
+  scan.height = 1;
+  return true;
+}
+
+// Downsampling the scan using VoxelGrid filter
+inline void voxelGridFilter(const pcl::PointCloud<pcl::PointXYZ>::Ptr &scan_ptr, double leaf_size,
+                            pcl::PointCloud<pcl::PointXYZ> &filtered_scan)
+{
+  pcl::VoxelGrid<pcl::PointXYZ> voxel_grid_filter;
+  voxel_grid_filter.setLeafSize(leaf_size, leaf_size, leaf_size);
+  voxel_grid_filter.setInputCloud(scan_ptr);//设置输入点云
+  voxel_grid_filter.filter(filtered_scan);//降采样
+}
+
+#endif
@@ -0,0 +1,464 @@
+#include "compact_ndt.h"
+
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+#include <Eigen/Eigenvalues>
+#include <Eigen/SVD>
+
+namespace {
+
+const int kMinPointsPerVoxel = 6;
+const int kKeyBits = 21;
+const int64_t kKeyOffset = int64_t(1) << (kKeyBits - 1);
+const int64_t kKeyMask = (int64_t(1) << kKeyBits) - 1;
+const uint32_t kEmptySlot = 0xffffffff;
+
+struct VoxelAccum {
+    Eigen::Vector3d sum;
+    Eigen::Matrix3d sum_sq;
+    int num;
+    VoxelAccum() : sum(Eigen::Vector3d::Zero()), sum_sq(Eigen::Matrix3d::Zero()), num(0) {}
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+inline uint64_t mixKey(int64_t key){
+    uint64_t z = static_cast<uint64_t>(key) + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+} // namespace
+
+CompactNdt::CompactNdt()
+    : trans_epsilon_(0.1), step_size_(0.1), resolution_(1.0f), max_iterations_(35),
+      precision_(FLOAT), outlier_ratio_(0.55), gauss_d1_(0.0), gauss_d2_(0.0), index_mask_(0),
+      final_transformation_(Eigen::Matrix4f::Identity()), trans_probability_(0.0), nr_iterations_(0)
+{
+}
+
+int64_t CompactNdt::voxelKey(int ix, int iy, int iz) const
+{
+    return (((ix + kKeyOffset) & kKeyMask) << (2 * kKeyBits)) |
+           (((iy + kKeyOffset) & kKeyMask) << kKeyBits) |
+           ((iz + kKeyOffset) & kKeyMask);
+}
+
+int CompactNdt::findVoxel(int64_t key) const
+{
+    if (index_.empty()) return -1;
+    const uint64_t hash = mixKey(key);
+    const uint32_t tag = static_cast<uint32_t>(hash >> 32);
+    uint64_t slot = hash & index_mask_;
+    while (true) {
+        const IndexEntry &entry = index_[slot];
+        if (entry.voxel == kEmptySlot) return -1;
+        if (entry.tag == tag && meanVoxelKey(&voxel_means_[3 * entry.voxel]) == key) return entry.voxel;
+        slot = (slot + 1) & index_mask_;
+    }
+}
+
+//体素均值保证落在自身栅格内, 因此可由均值恢复体素的键
+int64_t CompactNdt::meanVoxelKey(const float *mean) const
+{
+    const double inv_res = 1.0 / resolution_;
+    return voxelKey(static_cast<int>(std::floor(mean[0] * inv_res)),
+                    static_cast<int>(std::floor(mean[1] * inv_res)),
+                    static_cast<int>(std::floor(mean[2] * inv_res)));
+}
+
+int CompactNdt::findVoxel(const Eigen::Vector3f &point) const
+{
+    const float inv_res = 1.0f / resolution_;
+    return findVoxel(voxelKey(static_cast<int>(std::floor(point(0) * inv_res)),
+                              static_cast<int>(std::floor(point(1) * inv_res)),
+                              static_cast<int>(std::floor(point(2) * inv_res))));
+}
+
+void CompactNdt::insertIndex(int64_t key, uint32_t voxel)
+{
+    const uint64_t hash = mixKey(key);
+    uint64_t slot = hash & index_mask_;
+    while (index_[slot].voxel != kEmptySlot) slot = (slot + 1) & index_mask_;
+    index_[slot].voxel = voxel;
+    index_[slot].tag = static_cast<uint32_t>(hash >> 32);
+}
+
+//由地图点云构建体素的均值和逆协方差,原始点只在构建过程中使用
+void CompactNdt::setInputTarget(const pcl::PointCloud<pcl::PointXYZ> &map)
+{
+    const double res = resolution_;
+    const double inv_res = 1.0 / res;
+
+    // 以体素中心为参考累加, 避免大坐标下的精度损失
+    std::unordered_map<int64_t, VoxelAccum, std::hash<int64_t>, std::equal_to<int64_t>,
+                       Eigen::aligned_allocator<std::pair<const int64_t, VoxelAccum> > > accums;
+    for (const auto &pt : map.points) {
+        if (!std::isfinite(pt.x) || !std::isfinite(pt.y) || !std::isfinite(pt.z)) continue;
+        const int ix = static_cast<int>(std::floor(pt.x * inv_res));
+        const int iy = static_cast<int>(std::floor(pt.y * inv_res));
+        const int iz = static_cast<int>(std::floor(pt.z * inv_res));
+        const Eigen::Vector3d center((ix + 0.5) * res, (iy + 0.5) * res, (iz + 0.5) * res);
+        const Eigen::Vector3d d = Eigen::Vector3d(pt.x, pt.y, pt.z) - center;
+        VoxelAccum &acc = accums[voxelKey(ix, iy, iz)];
+        acc.sum += d;
+        acc.sum_sq += d * d.transpose();
+        ++acc.num;
+    }
+
+    voxel_means_.clear();
+    voxel_icov_f_.clear();
+    voxel_icov_h_.clear();
+    voxel_icov_scale_.clear();
+    index_.clear();
+
+    std::vector<int64_t> keys;
+    keys.reserve(accums.size());
+    voxel_means_.reserve(accums.size() * 3);
+    if (precision_ == FLOAT) voxel_icov_f_.reserve(accums.size() * 6);
+    else {
+        voxel_icov_h_.reserve(accums.size() * 6);
+        voxel_icov_scale_.reserve(accums.size());
+    }
+
+    for (const auto &kv : accums) {
+        const VoxelAccum &acc = kv.second;
+        if (acc.num < kMinPointsPerVoxel) continue;
+
+        const Eigen::Vector3d mean_local = acc.sum / acc.num;
+        Eigen::Matrix3d cov = (acc.sum_sq - acc.num * mean_local * mean_local.transpose()) / (acc.num - 1);
+
+        // 与pcl一致: 特征值过小时按最大特征值的比例放大, 防止协方差奇异
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigensolver(cov);
+        Eigen::Vector3d eigen_val = eigensolver.eigenvalues();
+        const Eigen::Matrix3d eigen_vec = eigensolver.eigenvectors();
+        if (eigen_val(0) < 0 || eigen_val(1) < 0 || eigen_val(2) <= 0) continue;
+        const double min_eigen_val = 0.01 * eigen_val(2);
+        if (eigen_val(0) < min_eigen_val || eigen_val(1) < min_eigen_val) {
+            eigen_val(0) = std::max(eigen_val(0), min_eigen_val);
+            eigen_val(1) = std::max(eigen_val(1), min_eigen_val);
+            cov = eigen_vec * eigen_val.asDiagonal() * eigen_vec.transpose();
+        }
+        const Eigen::Matrix3d icov = eigen_vec * eigen_val.cwiseInverse().asDiagonal() * eigen_vec.transpose();
+        if (!icov.allFinite()) continue;
+
+        const int64_t key = kv.first;
+        const int ix = static_cast<int>(((key >> (2 * kKeyBits)) & kKeyMask) - kKeyOffset);
+        const int iy = static_cast<int>(((key >> kKeyBits) & kKeyMask) - kKeyOffset);
+        const int iz = static_cast<int>((key & kKeyMask) - kKeyOffset);
+        const Eigen::Vector3d mean = mean_local + Eigen::Vector3d((ix + 0.5) * res, (iy + 0.5) * res, (iz + 0.5) * res);
+
+        // 转为float后若舍入到相邻栅格, 向体素中心方向微调, 使meanVoxelKey与键一致
+        const int index[3] = {ix, iy, iz};
+        for (int i = 0; i < 3; ++i) {
+            float value = mean(i);
+            const float center = (index[i] + 0.5) * res;
+            while (static_cast<int>(std::floor(value * (1.0 / res))) != index[i]) value = std::nextafter(value, center);
+            voxel_means_.push_back(value);
+        }
+        const double packed[6] = {icov(0, 0), icov(0, 1), icov(0, 2), icov(1, 1), icov(1, 2), icov(2, 2)};
+        if (precision_ == FLOAT) {
+            for (int i = 0; i < 6; ++i) voxel_icov_f_.push_back(packed[i]);
+        } else {
+            const float scale = icov.cwiseAbs().maxCoeff();
+            voxel_icov_scale_.push_back(scale);
+            for (int i = 0; i < 6; ++i) voxel_icov_h_.push_back(floatToHalf(packed[i] / scale));
+        }
+        keys.push_back(key);
+    }
+    accums.clear();
+
+    // 负载因子不超过0.75的开放寻址哈希表
+    std::size_t table_size = 16;
+    while (table_size * 3 < keys.size() * 4) table_size <<= 1;
+    IndexEntry empty;
+    empty.voxel = kEmptySlot;
+    empty.tag = 0;
+    index_.assign(table_size, empty);
+    index_mask_ = table_size - 1;
+    for (std::size_t i = 0; i < keys.size(); ++i) insertIndex(keys[i], i);
+
+    voxel_means_.shrink_to_fit();
+    voxel_icov_f_.shrink_to_fit();
+    voxel_icov_h_.shrink_to_fit();
+    voxel_icov_scale_.shrink_to_fit();
+
+    // 与pcl::NormalDistributionsTransform相同的高斯拟合参数
+    const double gauss_c1 = 10.0 * (1 - outlier_ratio_);
+    const double gauss_c2 = outlier_ratio_ / std::pow(res, 3);
+    const double gauss_d3 = -std::log(gauss_c2);
+    gauss_d1_ = -std::log(gauss_c1 + gauss_c2) - gauss_d3;
+    gauss_d2_ = -2 * std::log((-std::log(gauss_c1 * std::exp(-0.5) + gauss_c2) - gauss_d3) / gauss_d1_);
+}
+
+std::size_t CompactNdt::getMemoryFootprint() const
+{
+    return voxel_means_.capacity() * sizeof(float) +
+           voxel_icov_f_.capacity() * sizeof(float) +
+           voxel_icov_h_.capacity() * sizeof(uint16_t) +
+           voxel_icov_scale_.capacity() * sizeof(float) +
+           index_.capacity() * sizeof(IndexEntry);
+}
+
+void CompactNdt::loadVoxel(int voxel, Eigen::Vector3d &mean, Eigen::Matrix3d &icov) const
+{
+    const float *m = &voxel_means_[3 * voxel];
+    mean << m[0], m[1], m[2];
+    double c[6];
+    if (precision_ == FLOAT) {
+        const float *f = &voxel_icov_f_[6 * voxel];
+        for (int i = 0; i < 6; ++i) c[i] = f[i];
+    } else {
+        const uint16_t *h = &voxel_icov_h_[6 * voxel];
+        const double scale = voxel_icov_scale_[voxel];
+        for (int i = 0; i < 6; ++i) c[i] = scale * halfToFloat(h[i]);
+    }
+    icov << c[0], c[1], c[2],
+            c[1], c[3], c[4],
+            c[2], c[4], c[5];
+}
+
+Eigen::Matrix4f CompactNdt::poseToMatrix(const Eigen::Matrix<double, 6, 1> &p)
+{
+    const Eigen::Affine3d t = Eigen::Translation3d(p(0), p(1), p(2)) *
+                              Eigen::AngleAxisd(p(3), Eigen::Vector3d::UnitX()) *
+                              Eigen::AngleAxisd(p(4), Eigen::Vector3d::UnitY()) *
+                              Eigen::AngleAxisd(p(5), Eigen::Vector3d::UnitZ());
+    return t.matrix().cast<float>();
+}
+
+Eigen::Matrix<double, 6, 1> CompactNdt::matrixToPose(const Eigen::Matrix4f &m)
+{
+    const Eigen::Matrix4d md = m.cast<double>();
+    const Eigen::Vector3d euler = md.block<3, 3>(0, 0).eulerAngles(0, 1, 2);
+    Eigen::Matrix<double, 6, 1> p;
+    p << md(0, 3), md(1, 3), md(2, 3), euler(0), euler(1), euler(2);
+    return p;
+}
+
+//计算得分, 以及(可选的)梯度和Hessian矩阵, 公式与pcl的ndt实现一致 [Magnusson 2009]
+double CompactNdt::computeDerivatives(const Eigen::Matrix<double, 6, 1> &p,
+                                      Eigen::Matrix<double, 6, 1> *gradient,
+                                      Eigen::Matrix<double, 6, 6> *hessian) const
+{
+    const bool compute_derivatives = gradient != nullptr && hessian != nullptr;
+    if (compute_derivatives) {
+        gradient->setZero();
+        hessian->setZero();
+    }
+
+    const double cx = std::cos(p(3)), sx = std::sin(p(3));
+    const double cy = std::cos(p(4)), sy = std::sin(p(4));
+    const double cz = std::cos(p(5)), sz = std::sin(p(5));
+
+    // 角度的一阶导数 (Magnusson 2009, 式6.19)
+    Eigen::Matrix<double, 8, 3> j_ang;
+    j_ang << (-sx * sz + cx * sy * cz), (-sx * cz - cx * sy * sz), (-cx * cy),
+             (cx * sz + sx * sy * cz), (cx * cz - sx * sy * sz), (-sx * cy),
+             (-sy * cz), sy * sz, cy,
+             sx * cy * cz, (-sx * cy * sz), sx * sy,
+             (-cx * cy * cz), cx * cy * sz, (-cx * sy),
+             (-cy * sz), (-cy * cz), 0,
+             (cx * cz - sx * sy * sz), (-cx * sz - sx * sy * cz), 0,
+             (sx * cz + cx * sy * sz), (cx * sy * cz - sx * sz), 0;
+
+    // 角度的二阶导数 (Magnusson 2009, 式6.21)
+    Eigen::Matrix<double, 15, 3> h_ang;
+    h_ang << (-cx * sz - sx * sy * cz), (-cx * cz + sx * sy * sz), sx * cy,
+             (-sx * sz + cx * sy * cz), (-cx * sy * sz - sx * cz), (-cx * cy),
+             (cx * cy * cz), (-cx * cy * sz), (cx * sy),
+             (sx * cy * cz), (-sx * cy * sz), (sx * sy),
+             (-sx * cz - cx * sy * sz), (sx * sz - cx * sy * cz), 0,
+             (cx * cz - sx * sy * sz), (-sx * sy * cz - cx * sz), 0,
+             (-cy * cz), (cy * sz), (sy),
+             (-sx * sy * cz), (sx * sy * sz), (sx * cy),
+             (cx * sy * cz), (-cx * sy * sz), (-cx * cy),
+             (sy * sz), (sy * cz), 0,
+             (-sx * cy * sz), (-sx * cy * cz), 0,
+             (cx * cy * sz), (cx * cy * cz), 0,
+             (-cy * cz), (cy * sz), 0,
+             (-cx * sz - sx * sy * cz), (-cx * cz + sx * sy * sz), 0,
+             (-sx * sz + cx * sy * cz), (-cx * sy * sz - sx * cz), 0;
+
+    const Eigen::Matrix4d transform = poseToMatrix(p).cast<double>();
+    const Eigen::Matrix3d rot = transform.block<3, 3>(0, 0);
+    const Eigen::Vector3d trans = transform.block<3, 1>(0, 3);
+    const double inv_res = 1.0 / resolution_;
+    static const int kNeighbors[7][3] = {{0, 0, 0}, {1, 0, 0}, {-1, 0, 0}, {0, 1, 0},
+                                         {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+
+    Eigen::Matrix<double, 3, 6> point_gradient;
+    point_gradient.setZero();
+    point_gradient.block<3, 3>(0, 0).setIdentity();
+    Eigen::Matrix<double, 18, 6> point_hessian;
+    point_hessian.setZero();
+
+    double score = 0;
+    Eigen::Vector3d mean;
+    Eigen::Matrix3d icov;
+    for (const auto &pt : source_->points) {
+        const Eigen::Vector3d x(pt.x, pt.y, pt.z);
+        const Eigen::Vector3d x_trans = rot * x + trans;
+
+        if (compute_derivatives) {
+            point_gradient(1, 3) = x.dot(j_ang.row(0));
+            point_gradient(2, 3) = x.dot(j_ang.row(1));
+            point_gradient(0, 4) = x.dot(j_ang.row(2));
+            point_gradient(1, 4) = x.dot(j_ang.row(3));
+            point_gradient(2, 4) = x.dot(j_ang.row(4));
+            point_gradient(0, 5) = x.dot(j_ang.row(5));
+            point_gradient(1, 5) = x.dot(j_ang.row(6));
+            point_gradient(2, 5) = x.dot(j_ang.row(7));
+
+            const Eigen::Vector3d a(0, x.dot(h_ang.row(0)), x.dot(h_ang.row(1)));
+            const Eigen::Vector3d b(0, x.dot(h_ang.row(2)), x.dot(h_ang.row(3)));
+            const Eigen::Vector3d c(0, x.dot(h_ang.row(4)), x.dot(h_ang.row(5)));
+            const Eigen::Vector3d d(x.dot(h_ang.row(6)), x.dot(h_ang.row(7)), x.dot(h_ang.row(8)));
+            const Eigen::Vector3d e(x.dot(h_ang.row(9)), x.dot(h_ang.row(10)), x.dot(h_ang.row(11)));
+            const Eigen::Vector3d f(x.dot(h_ang.row(12)), x.dot(h_ang.row(13)), x.dot(h_ang.row(14)));
+            point_hessian.block<3, 1>(9, 3) = a;
+            point_hessian.block<3, 1>(12, 3) = b;
+            point_hessian.block<3, 1>(15, 3) = c;
+            point_hessian.block<3, 1>(9, 4) = b;
+            point_hessian.block<3, 1>(12, 4) = d;
+            point_hessian.block<3, 1>(15, 4) = e;
+            point_hessian.block<3, 1>(9, 5) = c;
+            point_hessian.block<3, 1>(12, 5) = e;
+            point_hessian.block<3, 1>(15, 5) = f;
+        }
+
+        const int ix = static_cast<int>(std::floor(x_trans(0) * inv_res));
+        const int iy = static_cast<int>(std::floor(x_trans(1) * inv_res));
+        const int iz = static_cast<int>(std::floor(x_trans(2) * inv_res));
+        for (int n = 0; n < 7; ++n) {
+            const int voxel = findVoxel(voxelKey(ix + kNeighbors[n][0], iy + kNeighbors[n][1], iz + kNeighbors[n][2]));
+            if (voxel < 0) continue;
+            loadVoxel(voxel, mean, icov);
+            const Eigen::Vector3d x_diff = x_trans - mean;
+
+            double e_x_cov_x = std::exp(-gauss_d2_ * x_diff.dot(icov * x_diff) / 2);
+            const double score_inc = -gauss_d1_ * e_x_cov_x;
+            e_x_cov_x = gauss_d2_ * e_x_cov_x;
+            if (e_x_cov_x > 1 || e_x_cov_x < 0 || e_x_cov_x != e_x_cov_x) continue;
+            score += score_inc;
+            if (!compute_derivatives) continue;
+
+            e_x_cov_x *= gauss_d1_;
+            const Eigen::Matrix<double, 3, 6> cov_dxd_pi = icov * point_gradient;
+            for (int i = 0; i < 6; ++i) {
+                const double x_cov_dxd_pi = x_diff.dot(cov_dxd_pi.col(i));
+                (*gradient)(i) += x_cov_dxd_pi * e_x_cov_x;
+                for (int j = 0; j < 6; ++j) {
+                    (*hessian)(i, j) += e_x_cov_x *
+                        (-gauss_d2_ * x_cov_dxd_pi * x_diff.dot(cov_dxd_pi.col(j)) +
+                         x_diff.dot(icov * point_hessian.block<3, 1>(3 * i, j)) +
+                         point_gradient.col(j).dot(cov_dxd_pi.col(i)));
+                }
+            }
+        }
+    }
+    return score;
+}
+
+//牛顿法迭代, 步长不超过step_size, 得分不上升时步长减半
+void CompactNdt::align(pcl::PointCloud<pcl::PointXYZ> &output, const Eigen::Matrix4f &guess)
+{
+    nr_iterations_ = 0;
+    trans_probability_ = 0;
+    final_transformation_ = guess;
+    output.clear();
+    if (!source_ || source_->empty() || !hasTarget()) return;
+
+    Eigen::Matrix<double, 6, 1> p = matrixToPose(guess);
+    Eigen::Matrix<double, 6, 1> gradient;
+    Eigen::Matrix<double, 6, 6> hessian;
+    double score = computeDerivatives(p, &gradient, &hessian);
+
+    while (nr_iterations_ < max_iterations_) {
+        Eigen::JacobiSVD<Eigen::Matrix<double, 6, 6> > sv(hessian, Eigen::ComputeFullU | Eigen::ComputeFullV);
+        Eigen::Matrix<double, 6, 1> delta_p = sv.solve(-gradient);
+        double delta_p_norm = delta_p.norm();
+        if (delta_p_norm < trans_epsilon_ || delta_p_norm != delta_p_norm) break;
+        delta_p /= delta_p_norm;
+        // 保证沿得分上升方向搜索
+        if (gradient.dot(delta_p) < 0) delta_p = -delta_p;
+
+        double step = std::min(delta_p_norm, step_size_);
+        Eigen::Matrix<double, 6, 1> p_new = p + step * delta_p;
+        double score_new = computeDerivatives(p_new, nullptr, nullptr);
+        for (int i = 0; i < 4 && score_new < score; ++i) {
+            step /= 2;
+            p_new = p + step * delta_p;
+            score_new = computeDerivatives(p_new, nullptr, nullptr);
+        }
+
+        ++nr_iterations_;
+        if (score_new < score) break;
+        p = p_new;
+        score = computeDerivatives(p, &gradient, &hessian);
+    }
+
+    final_transformation_ = poseToMatrix(p);
+    trans_probability_ = score / static_cast<double>(source_->size());
+    output.resize(source_->size());
+    for (std::size_t i = 0; i < source_->size(); ++i) {
+        const Eigen::Vector4f pt = final_transformation_ * source_->points[i].getVector4fMap();
+        output.points[i].x = pt(0);
+        output.points[i].y = pt(1);
+        output.points[i].z = pt(2);
+    }
+}
+
+uint16_t CompactNdt::floatToHalf(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    const int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 31) return sign | 0x7c00;
+    if (exponent <= 0) {
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        uint16_t half = static_cast<uint16_t>(mantissa >> shift);
+        if ((mantissa >> (shift - 1)) & 1) ++half;
+        return sign | half;
+    }
+    uint16_t half = sign | static_cast<uint16_t>(exponent << 10) | static_cast<uint16_t>(mantissa >> 13);
+    if (mantissa & 0x1000) ++half;  // 舍入, 进位可能溢出到指数位, 结果依然正确
+    return half;
+}
+
+float CompactNdt::halfToFloat(uint16_t value)
+{
+    const uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1f;
+    uint32_t mantissa = value & 0x3ff;
+    uint32_t bits;
+
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else {
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                --exponent;
+            }
+            mantissa &= 0x3ff;
+            bits = sign | (exponent << 23) | (mantissa << 13);
+        }
+    } else if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
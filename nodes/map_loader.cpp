@@ -1,25 +1,236 @@
 #include "map_loader.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
 MapLoader::MapLoader(ros::NodeHandle &nh){
-    std::string pcd_file_path, map_topic;
+    std::string pcd_file_path, map_topic, map_view_topic;
+    bool publish_full_map, serve_map_queries;
+    double map_view_resolution;
     nh.param<std::string>("pcd_path", pcd_file_path, "");
     nh.param<std::string>("map_topic", map_topic, "point_map");
+    //ndt_localizer和voxel_grid_filter默认通过query_map服务按区域获取地图, 不再需要锁存的完整地图
+    nh.param<bool>("publish_full_map", publish_full_map, false);
+    nh.param<bool>("serve_map_queries", serve_map_queries, true);
+    //供rviz显示的降采样地图概览, <=0时不发布
+    nh.param<std::string>("map_view_topic", map_view_topic, "points_map_view");
+    nh.param<double>("map_view_resolution", map_view_resolution, 1.0);
+    nh.param<double>("tile_size", tile_size_, 20.0);
+    if (!(tile_size_ > 0) || !std::isfinite(tile_size_)) {
+        ROS_ERROR_STREAM("invalid tile_size: " << tile_size_ << ", use 20.0");
+        tile_size_ = 20.0;
+    }
+    if (!publish_full_map && !serve_map_queries) {
+        ROS_WARN("publish_full_map and serve_map_queries are both false: localizers get no map");
+    }
+    nh.param<bool>("save_map", save_map_, false);
+    nh.param<std::string>("save_map_path", save_map_path_, "/tmp/transformed_map.pcd");
     //设置map初始的变换参数,若不需要则全部设置为0,此设置在map_load.launch文件中
     init_tf_params(nh);
 
-    pc_map_pub_ = nh.advertise<sensor_msgs::PointCloud2>(map_topic, 10, true);
+    if (publish_full_map) pc_map_pub_ = nh.advertise<sensor_msgs::PointCloud2>(map_topic, 10, true);
+    if (map_view_resolution > 0) map_view_pub_ = nh.advertise<sensor_msgs::PointCloud2>(map_view_topic, 1, true);
 
     file_list_.push_back(pcd_file_path);
 
     auto pc_msg = CreatePcd();
     
     auto out_msg = TransformMap(pc_msg);
+    pc_msg = sensor_msgs::PointCloud2();
 
     if (out_msg.width != 0) {
 		out_msg.header.frame_id = "map";
-		pc_map_pub_.publish(out_msg);//发布地图点云
+		if (publish_full_map) pc_map_pub_.publish(out_msg);//发布地图点云
 	}
 
+    // 内存: 锁存的发布者保留一份序列化的完整地图, 索引在map_points_中保留一份点云.
+    // 建索引时消息和map_points_同时存在, 因此publish_full_map为true时峰值约为地图的三倍、常驻约两倍,
+    // 为false时峰值约两倍、常驻约一倍
+    if (!serve_map_queries && map_view_resolution <= 0) return;
+    BuildTileIndex(out_msg);
+    if (map_view_resolution > 0) PublishMapView(map_view_resolution);
+    if (serve_map_queries) {
+        query_map_srv_ = nh.advertiseService("query_map", &MapLoader::QueryMap, this);
+    } else {
+        // 只发布概览时不保留索引
+        pcl::PointCloud<pcl::PointXYZ>().swap(map_points_);
+        tile_index_.clear();
+    }
+}
+
+MapLoader::~MapLoader(){
+    if (save_map_thread_.joinable()) save_map_thread_.join();
+}
+
+int MapLoader::TileCoord(double v) const{
+    return static_cast<int>(std::floor(v / tile_size_));
+}
+
+int64_t MapLoader::TileKey(int tx, int ty) const{
+    return static_cast<int64_t>((static_cast<uint64_t>(static_cast<uint32_t>(tx)) << 32) | static_cast<uint32_t>(ty));
+}
+
+//按瓦片对地图点排序并建立索引, 查询时只需遍历与查询区域相交的瓦片
+//转换后即释放输入消息, 点在map_points_上按瓦片键原地排序, 不需要额外的按点分配的数组
+void MapLoader::BuildTileIndex(sensor_msgs::PointCloud2 & map){
+    map_points_.clear();
+    tile_index_.clear();
+    pcl::fromROSMsg(map, map_points_);
+    map = sensor_msgs::PointCloud2();
+
+    // 去除无效点, 避免瓦片坐标计算溢出
+    const double max_tile = std::numeric_limits<int>::max() - 1;
+    size_t valid = 0;
+    for (size_t i = 0; i < map_points_.size(); ++i) {
+        const auto &p = map_points_.points[i];
+        if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z) ||
+            std::fabs(p.x / tile_size_) > max_tile || std::fabs(p.y / tile_size_) > max_tile) continue;
+        map_points_.points[valid++] = p;
+    }
+    map_points_.resize(valid);
+
+    std::sort(map_points_.points.begin(), map_points_.points.end(),
+              [this](const pcl::PointXYZ &a, const pcl::PointXYZ &b) {
+                  return TileKey(TileCoord(a.x), TileCoord(a.y)) < TileKey(TileCoord(b.x), TileCoord(b.y));
+              });
+
+    min_tx_ = min_ty_ = std::numeric_limits<int>::max();
+    max_tx_ = max_ty_ = std::numeric_limits<int>::min();
+    int64_t last_key = 0;
+    for (size_t i = 0; i < map_points_.size(); ++i) {
+        const auto &p = map_points_.points[i];
+        const int tx = TileCoord(p.x), ty = TileCoord(p.y);
+        const int64_t key = TileKey(tx, ty);
+        if (i == 0 || key != last_key) {
+            min_tx_ = std::min(min_tx_, tx); max_tx_ = std::max(max_tx_, tx);
+            min_ty_ = std::min(min_ty_, ty); max_ty_ = std::max(max_ty_, ty);
+            tile_index_[key] = std::make_pair(static_cast<uint32_t>(i), static_cast<uint32_t>(i));
+            last_key = key;
+        }
+        tile_index_[key].second = i + 1;
+    }
+
+    ROS_INFO_STREAM("map tile index: " << map_points_.size() << " points in "
+                    << tile_index_.size() << " tiles of " << tile_size_ << "m");
+}
+
+//将查询范围换算为瓦片坐标并限制在地图的瓦片范围内
+static bool ClampTileRange(double min_v, double max_v, double tile_size, int min_tile, int max_tile,
+                           int & lo, int & hi){
+    const double lo_d = std::max(std::floor(min_v / tile_size), static_cast<double>(min_tile));
+    const double hi_d = std::min(std::floor(max_v / tile_size), static_cast<double>(max_tile));
+    if (lo_d > hi_d) return false;
+    lo = static_cast<int>(lo_d);
+    hi = static_cast<int>(hi_d);
+    return true;
+}
+
+void MapLoader::CollectTile(const std::pair<uint32_t, uint32_t> & range, const ndt_localizer::QueryMap::Request & req,
+                            const double bounds[6], pcl::PointCloud<pcl::PointXYZ> & region) const{
+    const bool by_radius = req.radius > 0;
+    const double square_radius = req.radius * req.radius;
+    for (uint32_t i = range.first; i < range.second; ++i) {
+        const auto &p = map_points_.points[i];
+        if (by_radius) {
+            const double dx = p.x - req.center.x, dy = p.y - req.center.y;
+            if (dx * dx + dy * dy > square_radius) continue;
+        } else if (p.x < bounds[0] || p.x > bounds[1] || p.y < bounds[2] || p.y > bounds[3] ||
+                   p.z < bounds[4] || p.z > bounds[5]) {
+            continue;
+        }
+        region.push_back(p);
+    }
+}
+
+//收集查询区域内的点; 降采样逐个瓦片进行, 避免大范围查询时VoxelGrid的体素索引溢出
+void MapLoader::CollectRegion(const ndt_localizer::QueryMap::Request & req,
+                              pcl::PointCloud<pcl::PointXYZ> & region) const{
+    const bool by_radius = req.radius > 0;
+    double bounds[6] = {req.min.x, req.max.x, req.min.y, req.max.y, req.min.z, req.max.z};
+    if (by_radius) {
+        bounds[0] = req.center.x - req.radius; bounds[1] = req.center.x + req.radius;
+        bounds[2] = req.center.y - req.radius; bounds[3] = req.center.y + req.radius;
+    }
+
+    int tx_min, tx_max, ty_min, ty_max;
+    if (tile_index_.empty() ||
+        !ClampTileRange(bounds[0], bounds[1], tile_size_, min_tx_, max_tx_, tx_min, tx_max) ||
+        !ClampTileRange(bounds[2], bounds[3], tile_size_, min_ty_, max_ty_, ty_min, ty_max)) {
+        return;
+    }
+
+    pcl::PointCloud<pcl::PointXYZ>::Ptr tile_points(new pcl::PointCloud<pcl::PointXYZ>);
+    pcl::PointCloud<pcl::PointXYZ> filtered;
+    pcl::VoxelGrid<pcl::PointXYZ> voxel_grid_filter;
+    if (req.resolution > 0) voxel_grid_filter.setLeafSize(req.resolution, req.resolution, req.resolution);
+    auto append_tile = [&](const std::pair<uint32_t, uint32_t> & range) {
+        if (req.resolution <= 0) {
+            CollectTile(range, req, bounds, region);
+            return;
+        }
+        tile_points->clear();
+        CollectTile(range, req, bounds, *tile_points);
+        if (tile_points->empty()) return;
+        voxel_grid_filter.setInputCloud(tile_points);
+        voxel_grid_filter.filter(filtered);
+        region += filtered;
+    };
+
+    const double range_tiles = (static_cast<double>(tx_max) - tx_min + 1) * (static_cast<double>(ty_max) - ty_min + 1);
+    if (range_tiles > tile_index_.size()) {
+        // 查询范围内的瓦片多于地图中的瓦片时直接遍历索引
+        for (const auto &tile : tile_index_) {
+            const int tx = static_cast<int32_t>(static_cast<uint64_t>(tile.first) >> 32);
+            const int ty = static_cast<int32_t>(static_cast<uint32_t>(tile.first));
+            if (tx < tx_min || tx > tx_max || ty < ty_min || ty > ty_max) continue;
+            append_tile(tile.second);
+        }
+    } else {
+        for (int tx = tx_min; tx <= tx_max; ++tx) {
+            for (int ty = ty_min; ty <= ty_max; ++ty) {
+                auto tile = tile_index_.find(TileKey(tx, ty));
+                if (tile == tile_index_.end()) continue;
+                append_tile(tile->second);
+            }
+        }
+    }
+}
+
+//按包围盒或半径查询地图, 并可按指定分辨率降采样
+bool MapLoader::QueryMap(ndt_localizer::QueryMap::Request & req, ndt_localizer::QueryMap::Response & res){
+    const double values[] = {req.min.x, req.min.y, req.min.z, req.max.x, req.max.y, req.max.z,
+                             req.center.x, req.center.y, req.center.z, req.radius, req.resolution};
+    for (double v : values) {
+        if (!std::isfinite(v)) {
+            ROS_ERROR("query_map: non-finite request rejected");
+            return false;
+        }
+    }
+
+    pcl::PointCloud<pcl::PointXYZ> region;
+    CollectRegion(req, region);
+    pcl::toROSMsg(region, res.points);
+    res.points.header.frame_id = "map";
+    res.points.header.stamp = ros::Time::now();
+    return true;
+}
+
+//发布整幅地图按resolution降采样后的概览, 供rviz等可视化使用
+void MapLoader::PublishMapView(double resolution){
+    ndt_localizer::QueryMap::Request req;
+    req.min.x = req.min.y = req.min.z = -std::numeric_limits<double>::max();
+    req.max.x = req.max.y = req.max.z = std::numeric_limits<double>::max();
+    req.resolution = resolution;
+
+    pcl::PointCloud<pcl::PointXYZ> view;
+    CollectRegion(req, view);
+    sensor_msgs::PointCloud2 view_msg;
+    pcl::toROSMsg(view, view_msg);
+    view_msg.header.frame_id = "map";
+    view_msg.header.stamp = ros::Time::now();
+    map_view_pub_.publish(view_msg);
+    ROS_INFO_STREAM("map view: " << view.size() << " points at " << resolution << "m");
 }
 
 void MapLoader::init_tf_params(ros::NodeHandle &nh){
@@ -36,6 +247,12 @@ void MapLoader::init_tf_params(ros::NodeHandle &nh){
 
 //用于平移和旋转地图,主要针对于地图初始化时的地图的平移与旋转
 sensor_msgs::PointCloud2 MapLoader::TransformMap(sensor_msgs::PointCloud2 & in){
+    // 变换参数全为0时不做拷贝和变换, 直接使用载入的地图
+    if (tf_x_ == 0 && tf_y_ == 0 && tf_z_ == 0 && tf_roll_ == 0 && tf_pitch_ == 0 && tf_yaw_ == 0) {
+        if (save_map_) SaveMap(in);
+        return std::move(in);
+    }
+
     pcl::PointCloud<pcl::PointXYZ>::Ptr in_pc(new pcl::PointCloud<pcl::PointXYZ>);
     pcl::fromROSMsg(in, *in_pc);//将ros点云转为pcl点云
 
@@ -48,16 +265,47 @@ sensor_msgs::PointCloud2 MapLoader::TransformMap(sensor_msgs::PointCloud2 & in){
     Eigen::Matrix4f tf_m2w = (tl_m2w * rot_z_m2w * rot_y_m2w * rot_x_m2w).matrix(); // 得到4*4齐次变换矩阵
 
     pcl::transformPointCloud(*in_pc, *transformed_pc_ptr, tf_m2w); // 依据tf_m2w变换矩阵将in_pc点云变换为transformed_pc_ptr
+    in_pc.reset();
 
-    SaveMap(transformed_pc_ptr); // 保存地图
+    if (save_map_) SaveMap(transformed_pc_ptr); // 保存地图
     
     sensor_msgs::PointCloud2 output_msg;
     pcl::toROSMsg(*transformed_pc_ptr, output_msg);//转化为ros点云
     return output_msg;
 }
 
+//pcl 1.8的压缩写出用unsigned int保存数据及压缩缓冲区(约1.5倍数据)的大小, 超过2GiB时改为不压缩的二进制
+static void WriteMap(const std::string & path, const pcl::PointCloud<pcl::PointXYZ> & map_pc){
+    const uint64_t data_size = static_cast<uint64_t>(map_pc.size()) * 3 * sizeof(float);
+    const bool compressed = data_size < (uint64_t(1) << 31);
+    const int ret = compressed ? pcl::io::savePCDFileBinaryCompressed(path, map_pc)
+                               : pcl::io::savePCDFileBinary(path, map_pc);
+    if (ret == 0) {
+        ROS_INFO_STREAM("saved transformed map to " << path << (compressed ? " (binary compressed)" : " (binary)"));
+    } else {
+        ROS_ERROR_STREAM("failed to save transformed map to " << path);
+    }
+}
+
+//后台线程写出地图, 不阻塞地图的发布
 void MapLoader::SaveMap(const pcl::PointCloud<pcl::PointXYZ>::Ptr map_pc_ptr){
-    pcl::io::savePCDFile("/tmp/transformed_map.pcd", *map_pc_ptr);
+    if (save_map_thread_.joinable()) save_map_thread_.join();
+    const std::string path = save_map_path_;
+    save_map_thread_ = std::thread([map_pc_ptr, path]() {
+        WriteMap(path, *map_pc_ptr);
+    });
+}
+
+//未做变换时保存载入的消息: 拷贝一份消息, 转换为pcl点云也在后台线程中进行
+void MapLoader::SaveMap(const sensor_msgs::PointCloud2 & map_msg){
+    if (save_map_thread_.joinable()) save_map_thread_.join();
+    const std::string path = save_map_path_;
+    sensor_msgs::PointCloud2::ConstPtr map_msg_ptr(new sensor_msgs::PointCloud2(map_msg));
+    save_map_thread_ = std::thread([map_msg_ptr, path]() {
+        pcl::PointCloud<pcl::PointXYZ> map_pc;
+        pcl::fromROSMsg(*map_msg_ptr, map_pc);
+        WriteMap(path, map_pc);
+    });
 }
 
 //加载pcd地图文件
@@ -15,11 +15,17 @@ NdtLocalizer::NdtLocalizer(ros::NodeHandle &nh, ros::NodeHandle &private_nh):nh_
 
   // Subscribers
   initial_pose_sub_ = nh_.subscribe("/initialpose", 100, &NdtLocalizer::callback_init_pose, this);//初始姿态
-  map_points_sub_ = nh_.subscribe("points_map", 1, &NdtLocalizer::callback_pointsmap, this);//pcd点云地图
+  if (!use_map_query_) {
+    map_points_sub_ = nh_.subscribe("points_map", 1, &NdtLocalizer::callback_pointsmap, this);//pcd点云地图
+  }
   sensor_points_sub_ = nh_.subscribe("filtered_points", 1, &NdtLocalizer::callback_pointcloud, this);//降采样后点云
 
   diagnostic_thread_ = std::thread(&NdtLocalizer::timer_diagnostic, this);
   diagnostic_thread_.detach();
+  if (use_map_query_) {
+    map_update_thread_ = std::thread(&NdtLocalizer::timer_map_update, this);
+    map_update_thread_.detach();
+  }
 }
 
 NdtLocalizer::~NdtLocalizer() {}
@@ -68,6 +74,62 @@ void NdtLocalizer::timer_diagnostic()
   }
 }
 
+//记录需要地图的位置, forced为true时(重新初始化)无论移动距离都重新查询
+void NdtLocalizer::set_map_query_position(const Eigen::Vector3d & position, bool forced)
+{
+  std::lock_guard<std::mutex> lock(map_query_mtx_);
+  map_query_position_ = position;
+  has_map_query_position_ = true;
+  map_query_forced_ = map_query_forced_ || forced;
+}
+
+//按当前位置通过query_map服务获取周围的地图并重建ndt目标
+void NdtLocalizer::timer_map_update()
+{
+  ros::Rate rate(10);
+  Eigen::Vector3d map_center;
+  bool has_map_center = false;
+  while (ros::ok()) {
+    rate.sleep();
+
+    Eigen::Vector3d position;
+    bool forced;
+    {
+      std::lock_guard<std::mutex> lock(map_query_mtx_);
+      if (!has_map_query_position_) continue;
+      position = map_query_position_;
+      forced = map_query_forced_;
+      map_query_forced_ = false;
+    }
+    if (!forced && has_map_center && (position - map_center).head<2>().norm() < map_update_distance_) continue;
+
+    ndt_localizer::QueryMap srv;
+    srv.request.center.x = position.x();
+    srv.request.center.y = position.y();
+    srv.request.center.z = position.z();
+    srv.request.radius = map_radius_;
+    srv.request.resolution = 0;//ndt需要原始分辨率的点计算体素协方差
+    if (!query_map_client_.call(srv)) {
+      ROS_WARN_THROTTLE(5, "query_map failed, retrying");
+      if (forced) set_map_query_position(position, true);
+      continue;
+    }
+    map_center = position;
+    has_map_center = true;
+
+    pcl::PointCloud<pcl::PointXYZ>::Ptr map_points_ptr(new pcl::PointCloud<pcl::PointXYZ>);
+    pcl::fromROSMsg(srv.response.points, *map_points_ptr);
+    srv.response.points = sensor_msgs::PointCloud2();
+    ROS_INFO("map region: %zu points within %.1fm of (%.1f, %.1f)",
+      map_points_ptr->size(), map_radius_, position.x(), position.y());
+    if (map_points_ptr->empty()) {
+      ROS_WARN("no map around the current position, keep the previous target");
+      continue;
+    }
+    update_target(std::move(map_points_ptr));
+  }
+}
+
 //将初始位姿变换到map坐标系下，并用initial_pose_cov_msg_表示
 void NdtLocalizer::callback_init_pose(
   const geometry_msgs::PoseWithCovarianceStamped::ConstPtr & initial_pose_msg_ptr)
@@ -90,18 +152,48 @@ void NdtLocalizer::callback_init_pose(
   }
   // if click the initpose again, re init！
   init_pose = false;
+
+  const auto & position = initial_pose_cov_msg_.pose.pose.position;
+  set_map_query_position(Eigen::Vector3d(position.x, position.y, position.z), true);
 }
 
-//将pcd点云设置为ndt的目标点云,并设置ndt各个参数
-//订阅map_loader中载入pcd点云后发布的话题消息
+//订阅map_loader中载入pcd点云后发布的话题消息(use_map_query为false时)
 void NdtLocalizer::callback_pointsmap(
   const sensor_msgs::PointCloud2::ConstPtr & map_points_msg_ptr)
+{
+  pcl::PointCloud<pcl::PointXYZ>::Ptr map_points_ptr(new pcl::PointCloud<pcl::PointXYZ>);
+  pcl::fromROSMsg(*map_points_msg_ptr, *map_points_ptr);//转为ros消息
+  update_target(std::move(map_points_ptr));
+}
+
+//将地图点云设置为ndt的目标点云,并设置ndt各个参数
+void NdtLocalizer::update_target(pcl::PointCloud<pcl::PointXYZ>::Ptr map_points_ptr)
 {
   const auto trans_epsilon = ndt_.getTransformationEpsilon();
   const auto step_size = ndt_.getStepSize();
   const auto resolution = ndt_.getResolution();
   const auto max_iterations = ndt_.getMaximumIterations();
 
+  if (use_compact_target_) {
+    CompactNdt compact_ndt_new;
+    compact_ndt_new.setTransformationEpsilon(trans_epsilon);
+    compact_ndt_new.setStepSize(step_size);
+    compact_ndt_new.setResolution(resolution);
+    compact_ndt_new.setMaximumIterations(max_iterations);
+    compact_ndt_new.setPrecision(compact_ndt_.getPrecision());
+    compact_ndt_new.setInputTarget(*map_points_ptr);//构建体素后原始点云即可释放
+    map_points_ptr.reset();
+
+    ROS_INFO("compact ndt target: %zu voxels, %.2f MB",
+      compact_ndt_new.getVoxelNum(), compact_ndt_new.getMemoryFootprint() / (1024.0 * 1024.0));
+
+    // swap
+    ndt_map_mtx_.lock();
+    compact_ndt_ = std::move(compact_ndt_new);
+    ndt_map_mtx_.unlock();
+    return;
+  }
+
   pcl::NormalDistributionsTransform<pcl::PointXYZ, pcl::PointXYZ> ndt_new;
 
   ndt_new.setTransformationEpsilon(trans_epsilon);
@@ -109,14 +201,16 @@ void NdtLocalizer::callback_pointsmap(
   ndt_new.setResolution(resolution);
   ndt_new.setMaximumIterations(max_iterations);
 
-  pcl::PointCloud<pcl::PointXYZ>::Ptr map_points_ptr(new pcl::PointCloud<pcl::PointXYZ>);
-  pcl::fromROSMsg(*map_points_msg_ptr, *map_points_ptr);//转为ros消息
   ndt_new.setInputTarget(map_points_ptr);//设置目标点云
   // create Thread
   // detach
   pcl::PointCloud<pcl::PointXYZ>::Ptr output_cloud(new pcl::PointCloud<pcl::PointXYZ>);
   ndt_new.align(*output_cloud, Eigen::Matrix4f::Identity());
 
+  // pcl的ndt还会额外保存体素均值、协方差及KD树, 这里只统计保留的原始点云
+  ROS_INFO("pcl ndt target: %zu map points retained, %.2f MB (excluding voxels and kd-tree)",
+    map_points_ptr->size(), map_points_ptr->size() * sizeof(pcl::PointXYZ) / (1024.0 * 1024.0));
+
   // swap
   ndt_map_mtx_.lock();
   ndt_ = ndt_new;
@@ -156,9 +250,13 @@ void NdtLocalizer::callback_pointcloud(
   
   // set input point cloud
   //将转换到base下的sensor点云设置为ndt的输入源
-  ndt_.setInputSource(sensor_points_baselinkTF_ptr);
+  if (use_compact_target_) {
+    compact_ndt_.setInputSource(sensor_points_baselinkTF_ptr);
+  } else {
+    ndt_.setInputSource(sensor_points_baselinkTF_ptr);
+  }
 
-  if (ndt_.getInputTarget() == nullptr) {//为空,说明地图无载入成功
+  if (use_compact_target_ ? !compact_ndt_.hasTarget() : ndt_.getInputTarget() == nullptr) {//为空,说明地图无载入成功
     ROS_WARN_STREAM_THROTTLE(1, "No MAP!");
     return;
   }
@@ -185,12 +283,17 @@ void NdtLocalizer::callback_pointcloud(
   const auto align_start_time = std::chrono::system_clock::now();
   key_value_stdmap_["state"] = "Aligning";
   //使用ndt配准
-  ndt_.align(*output_cloud, initial_pose_matrix);//配准
+  if (use_compact_target_) {
+    compact_ndt_.align(*output_cloud, initial_pose_matrix);
+  } else {
+    ndt_.align(*output_cloud, initial_pose_matrix);//配准
+  }
   key_value_stdmap_["state"] = "Sleeping";
   const auto align_end_time = std::chrono::system_clock::now();
   const double align_time = std::chrono::duration_cast<std::chrono::microseconds>(align_end_time - align_start_time).count() /1000.0;//配准用时
 
-  const Eigen::Matrix4f result_pose_matrix = ndt_.getFinalTransformation();//得到最终变换
+  const Eigen::Matrix4f result_pose_matrix = use_compact_target_ ?
+    compact_ndt_.getFinalTransformation() : ndt_.getFinalTransformation();//得到最终变换
   Eigen::Affine3d result_pose_affine;
   result_pose_affine.matrix() = result_pose_matrix.cast<double>();
   const geometry_msgs::Pose result_pose_msg = tf2::toMsg(result_pose_affine);
@@ -198,20 +301,26 @@ void NdtLocalizer::callback_pointcloud(
   const auto exe_end_time = std::chrono::system_clock::now();
   const double exe_time = std::chrono::duration_cast<std::chrono::microseconds>(exe_end_time - exe_start_time).count() / 1000.0;
 
-  const float transform_probability = ndt_.getTransformationProbability();
-  const int iteration_num = ndt_.getFinalNumIteration();
+  const float transform_probability = use_compact_target_ ?
+    compact_ndt_.getTransformationProbability() : ndt_.getTransformationProbability();
+  const int iteration_num = use_compact_target_ ?
+    compact_ndt_.getFinalNumIteration() : ndt_.getFinalNumIteration();
   
   //收敛判别
   bool is_converged = true;
   static size_t skipping_publish_num = 0;
   if (
-    iteration_num >= ndt_.getMaximumIterations() + 2 ||
+    // pcl的迭代次数在未收敛时会达到最大迭代次数+2, CompactNdt最多为最大迭代次数
+    (use_compact_target_ ? iteration_num >= compact_ndt_.getMaximumIterations()
+                         : iteration_num >= ndt_.getMaximumIterations() + 2) ||
     transform_probability < converged_param_transform_probability_) {
     is_converged = false;
     ++skipping_publish_num;
     std::cout << "Not Converged" << std::endl;
   } else {
     skipping_publish_num = 0;
+    // 只用收敛的位姿移动地图查询中心
+    if (use_map_query_) set_map_query_position(result_pose_affine.translation(), false);
   }
   // calculate the delta tf from pre_trans to current_trans
   delta_trans = pre_trans.inverse() * result_pose_matrix;
@@ -303,8 +412,49 @@ void NdtLocalizer::init_params(){
     "trans_epsilon: %lf, step_size: %lf, resolution: %lf, max_iterations: %d", trans_epsilon,
     step_size, resolution, max_iterations);
 
+  //目标地图表示: "pcl"使用pcl的ndt, "compact"使用只保存体素的紧凑表示
+  std::string ndt_target = "pcl";
+  std::string compact_precision = "float";
+  private_nh_.getParam("ndt_target", ndt_target);
+  private_nh_.getParam("compact_precision", compact_precision);
+  if (ndt_target != "pcl" && ndt_target != "compact") {
+    ROS_WARN("unknown ndt_target: %s, use pcl", ndt_target.c_str());
+    ndt_target = "pcl";
+  }
+  if (compact_precision != "float" && compact_precision != "half") {
+    ROS_WARN("unknown compact_precision: %s, use float", compact_precision.c_str());
+    compact_precision = "float";
+  }
+  use_compact_target_ = (ndt_target == "compact");
+  compact_ndt_.setTransformationEpsilon(trans_epsilon);
+  compact_ndt_.setStepSize(step_size);
+  compact_ndt_.setResolution(resolution);
+  compact_ndt_.setMaximumIterations(max_iterations);
+  compact_ndt_.setPrecision(compact_precision == "half" ? CompactNdt::HALF : CompactNdt::FLOAT);
+  ROS_INFO("ndt_target: %s, compact_precision: %s", ndt_target.c_str(), compact_precision.c_str());
+
   private_nh_.getParam(
     "converged_param_transform_probability", converged_param_transform_probability_);
+
+  //地图来源: 通过query_map服务按区域获取, 或订阅完整的地图话题
+  std::string map_query_service = "/map_loader/query_map";
+  private_nh_.getParam("use_map_query", use_map_query_);
+  private_nh_.getParam("map_query_service", map_query_service);
+  private_nh_.getParam("map_radius", map_radius_);
+  private_nh_.getParam("map_update_distance", map_update_distance_);
+  if (!(map_radius_ > 0) || !std::isfinite(map_radius_)) {
+    ROS_WARN("invalid map_radius: %lf, use 150.0", map_radius_);
+    map_radius_ = 150.0;
+  }
+  if (!(map_update_distance_ >= 0) || !std::isfinite(map_update_distance_)) {
+    ROS_WARN("invalid map_update_distance: %lf, use 30.0", map_update_distance_);
+    map_update_distance_ = 30.0;
+  }
+  if (use_map_query_) {
+    query_map_client_ = nh_.serviceClient<ndt_localizer::QueryMap>(map_query_service);
+    ROS_INFO("map from %s, radius: %lf, update distance: %lf",
+      map_query_service.c_str(), map_radius_, map_update_distance_);
+  }
 }
 
 //获取坐标变换关系
@@ -0,0 +1,564 @@
+//配准相关模块的微基准测试: 目标地图构建、单次迭代(得分/梯度/Hessian)、体素查找、降采样吞吐量及配准精度
+//结果以JSON输出, 精度不达标时返回非0
+//用法: rosrun ndt_localizer ndt_benchmark [--map map.pcd] [--scan scan_in_map.pcd] [--viewpoint x,y,z] [--output result.json]
+//未指定--scan时在viewpoint处按激光雷达模型由地图生成扫描
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <pcl/io/pcd_io.h>
+#include <pcl/registration/ndt.h>
+#include <pcl/common/transforms.h>
+
+#include "compact_ndt.h"
+#include "points_downsampler.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedMs(const Clock::time_point &start)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() / 1e6;
+}
+
+struct Options {
+  std::string map_path;
+  std::string scan_path;
+  std::string output_path;
+  double resolution = 2.0;
+  double step_size = 0.1;
+  double trans_epsilon = 0.01;
+  int max_iterations = 30;
+  double leaf_size = 3.0;
+  double source_leaf_size = 1.0;
+  double ground_cell_size = 1.0;
+  double ground_height_threshold = 0.2;
+  double ground_max_z = -1.0;
+  double static_map_resolution = 1.0;
+  double dynamic_min_keep_ratio = 0.5;
+  bool has_viewpoint = false;
+  Eigen::Vector3f viewpoint = Eigen::Vector3f::Zero();
+  int repeat = 5;
+  double max_translation_error = 0.1;
+  double max_rotation_error = 0.01;
+};
+
+//JSON输出: 非有限值输出为null, 字符串做转义
+static std::string jsonNumber(double value)
+{
+  if (!std::isfinite(value)) return "null";
+  std::ostringstream ss;
+  ss.precision(6);
+  ss << value;
+  return ss.str();
+}
+
+static std::string jsonString(const std::string &value)
+{
+  std::string out = "\"";
+  for (const char ch : value) {
+    const unsigned char c = static_cast<unsigned char>(ch);
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += ch;
+    } else if (c < 0x20) {
+      char buffer[8];
+      std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      out += buffer;
+    } else {
+      out += ch;
+    }
+  }
+  return out + "\"";
+}
+
+typedef std::vector<std::pair<std::string, std::string> > JsonFields;
+
+static std::string jsonObject(const JsonFields &fields, const std::string &indent)
+{
+  std::string out = "{\n";
+  for (size_t i = 0; i < fields.size(); ++i) {
+    out += indent + "  " + jsonString(fields[i].first) + ": " + fields[i].second;
+    out += (i + 1 < fields.size()) ? ",\n" : "\n";
+  }
+  return out + indent + "}";
+}
+
+//与标准库实现无关的随机数: mt19937的输出序列由标准规定, 而std::*_distribution在不同标准库上结果不同,
+//因此均匀分布和正态分布(Box-Muller)直接由mt19937的输出计算
+static double uniform(std::mt19937 &rng, double lo, double hi)
+{
+  return lo + (hi - lo) * (rng() / 4294967296.0);
+}
+
+static double gaussian(std::mt19937 &rng, double sigma)
+{
+  const double u1 = (rng() + 1.0) / 4294967297.0;
+  const double u2 = rng() / 4294967296.0;
+  return sigma * std::sqrt(-2.0 * std::log(u1)) * std::cos(2.0 * M_PI * u2);
+}
+
+//确定性的合成地图: 地面、四周墙面、立柱和斜面
+static void createSyntheticMap(pcl::PointCloud<pcl::PointXYZ> &map)
+{
+  std::mt19937 rng(42);
+
+  for (int i = 0; i < 100000; ++i) {
+    const float a = uniform(rng, -40, 40), b = uniform(rng, -40, 40), z = uniform(rng, 0, 6);
+    map.push_back(pcl::PointXYZ(a, b, gaussian(rng, 0.02)));
+    map.push_back(pcl::PointXYZ(40 + gaussian(rng, 0.02), a, z));
+    map.push_back(pcl::PointXYZ(-40 + gaussian(rng, 0.02), a, z));
+    map.push_back(pcl::PointXYZ(a, 40 + gaussian(rng, 0.02), z));
+    map.push_back(pcl::PointXYZ(a, -40 + gaussian(rng, 0.02), z));
+    map.push_back(pcl::PointXYZ(a + 0.5f * b, 0.3f * a + 10 + gaussian(rng, 0.02), z));
+  }
+  for (int pole = 0; pole < 40; ++pole) {
+    const float cx = uniform(rng, -32, 32), cy = uniform(rng, -32, 32);
+    for (int i = 0; i < 2000; ++i) {
+      const float angle = i * 0.1f;
+      map.push_back(pcl::PointXYZ(cx + 0.3f * std::cos(angle), cy + 0.3f * std::sin(angle), uniform(rng, 0, 6)));
+    }
+  }
+}
+
+//默认的传感器位置: 地图中心上方, 高度为中心10m内最低点之上1.9m(安装高度)
+static Eigen::Vector3f defaultViewpoint(const pcl::PointCloud<pcl::PointXYZ> &map)
+{
+  Eigen::Vector3f center(0, 0, 0);
+  for (const auto &p : map.points) center += p.getVector3fMap();
+  center /= std::max<size_t>(map.size(), 1);
+
+  float ground_z = std::numeric_limits<float>::max();
+  for (const auto &p : map.points) {
+    const float dx = p.x - center.x(), dy = p.y - center.y();
+    if (dx * dx + dy * dy <= 100.0f) ground_z = std::min(ground_z, p.z);
+  }
+  if (ground_z == std::numeric_limits<float>::max()) ground_z = center.z() - 1.9f;
+  return Eigen::Vector3f(center.x(), center.y(), ground_z + 1.9f);
+}
+
+//地图中不存在的物体(车辆大小的长方体表面), 用于模拟动态物体及其遮挡
+static void createDynamicObjects(const Eigen::Vector3f &viewpoint, pcl::PointCloud<pcl::PointXYZ> &objects)
+{
+  const float offsets[3][2] = {{8, 3}, {-12, -6}, {5, -9}};
+  const float length = 4.5f, width = 1.8f, height = 1.5f, step = 0.1f;
+  for (const auto &offset : offsets) {
+    const float x0 = viewpoint.x() + offset[0], y0 = viewpoint.y() + offset[1], z0 = viewpoint.z() - 1.9f;
+    for (float u = 0; u <= length; u += step) {
+      for (float v = 0; v <= height; v += step) {
+        objects.push_back(pcl::PointXYZ(x0 + u, y0, z0 + v));
+        objects.push_back(pcl::PointXYZ(x0 + u, y0 + width, z0 + v));
+      }
+      for (float v = 0; v <= width; v += step) objects.push_back(pcl::PointXYZ(x0 + u, y0 + v, z0 + height));
+    }
+    for (float u = 0; u <= width; u += step) {
+      for (float v = 0; v <= height; v += step) {
+        objects.push_back(pcl::PointXYZ(x0, y0 + u, z0 + v));
+        objects.push_back(pcl::PointXYZ(x0 + length, y0 + u, z0 + v));
+      }
+    }
+  }
+}
+
+//按激光雷达的方式由地图生成一帧确定性的扫描(map坐标系): 在viewpoint处按方位角0.2度、俯仰角0.5度(-25~15度)
+//划分光束, 每个光束只保留最近的点(遮挡), 加入地图中不存在的物体, 并施加沿光束方向的测距噪声和5%的丢点
+static size_t createSensorScan(const pcl::PointCloud<pcl::PointXYZ> &map, const Eigen::Vector3f &viewpoint,
+                               pcl::PointCloud<pcl::PointXYZ> &scan)
+{
+  const double azimuth_res = 0.2 * M_PI / 180, elevation_res = 0.5 * M_PI / 180;
+  const double min_elevation = -25 * M_PI / 180, max_elevation = 15 * M_PI / 180;
+  const double max_range = 100.0, range_noise = 0.03, dropout = 0.05;
+  const int azimuth_bins = static_cast<int>(std::ceil(2 * M_PI / azimuth_res));
+  const int elevation_bins = static_cast<int>(std::ceil((max_elevation - min_elevation) / elevation_res));
+
+  pcl::PointCloud<pcl::PointXYZ> objects;
+  createDynamicObjects(viewpoint, objects);
+
+  // 每个光束最近的点: 序号小于map.size()为地图点, 否则为物体点
+  std::vector<float> nearest(static_cast<size_t>(azimuth_bins) * elevation_bins, std::numeric_limits<float>::max());
+  std::vector<size_t> hit(nearest.size(), 0);
+  const size_t total = map.size() + objects.size();
+  for (size_t i = 0; i < total; ++i) {
+    const pcl::PointXYZ &p = i < map.size() ? map.points[i] : objects.points[i - map.size()];
+    const Eigen::Vector3f d = p.getVector3fMap() - viewpoint;
+    const float range = d.norm();
+    if (!(range > 0.5f) || range > max_range) continue;
+    const double elevation = std::asin(d.z() / range);
+    if (elevation < min_elevation || elevation >= max_elevation) continue;
+    const int ia = std::min(static_cast<int>((std::atan2(d.y(), d.x()) + M_PI) / azimuth_res), azimuth_bins - 1);
+    const int ie = std::min(static_cast<int>((elevation - min_elevation) / elevation_res), elevation_bins - 1);
+    const size_t bin = static_cast<size_t>(ie) * azimuth_bins + ia;
+    if (range < nearest[bin]) {
+      nearest[bin] = range;
+      hit[bin] = i;
+    }
+  }
+
+  std::mt19937 rng(7);
+  size_t object_points = 0;
+  for (size_t bin = 0; bin < nearest.size(); ++bin) {
+    if (nearest[bin] == std::numeric_limits<float>::max()) continue;
+    const double noise = gaussian(rng, range_noise);
+    if (uniform(rng, 0, 1) < dropout) continue;
+    const size_t i = hit[bin];
+    const pcl::PointXYZ &p = i < map.size() ? map.points[i] : objects.points[i - map.size()];
+    const Eigen::Vector3f d = p.getVector3fMap() - viewpoint;
+    const Eigen::Vector3f q = viewpoint + d * static_cast<float>((nearest[bin] + noise) / nearest[bin]);
+    scan.push_back(pcl::PointXYZ(q.x(), q.y(), q.z()));
+    object_points += i >= map.size();
+  }
+  return object_points;
+}
+
+struct AlignResult {
+  double target_build_ms = 0;
+  double align_ms = 0;
+  double iterations = 0;
+  double transform_probability = 0;
+  double translation_error = 0;
+  double rotation_error = 0;
+  double evaluate_ms = 0;
+  double evaluate_score = 0;
+  double neighbor_lookup_ns = 0;
+  double neighbor_hit_ratio = 0;
+  double memory_bytes = NAN;
+};
+
+static void poseError(const Eigen::Matrix4f &result, const Eigen::Matrix4f &truth, AlignResult &out)
+{
+  const Eigen::Matrix4f error = truth.inverse() * result;
+  out.translation_error = error.block<3, 1>(0, 3).norm();
+  out.rotation_error = Eigen::AngleAxisf(Eigen::Matrix3f(error.block<3, 3>(0, 0))).angle();
+}
+
+//暴露pcl ndt中受保护的单次迭代计算和体素邻域查询
+class BenchmarkPclNdt : public pcl::NormalDistributionsTransform<pcl::PointXYZ, pcl::PointXYZ> {
+public:
+  double evaluate(const Eigen::Matrix4f &transform, Eigen::Matrix<double, 6, 1> &gradient,
+                  Eigen::Matrix<double, 6, 6> &hessian)
+  {
+    pcl::PointCloud<pcl::PointXYZ> trans_cloud;
+    pcl::transformPointCloud(*input_, trans_cloud, transform);
+    const Eigen::Vector3f euler = Eigen::Matrix3f(transform.block<3, 3>(0, 0)).eulerAngles(0, 1, 2);
+    Eigen::Matrix<double, 6, 1> p;
+    p << transform(0, 3), transform(1, 3), transform(2, 3), euler(0), euler(1), euler(2);
+    return computeDerivatives(gradient, hessian, trans_cloud, p, true);
+  }
+
+  //与computeDerivatives中相同的半径查询
+  int neighbors(const pcl::PointXYZ &point)
+  {
+    std::vector<TargetGridLeafConstPtr> leaves;
+    std::vector<float> distances;
+    return target_cells_.radiusSearch(point, resolution_, leaves, distances);
+  }
+};
+
+//与NdtLocalizer::callback_pointsmap相同的流程构建pcl的ndt目标
+static AlignResult benchmarkPclNdt(const Options &opt, const pcl::PointCloud<pcl::PointXYZ>::Ptr &map,
+                                   const pcl::PointCloud<pcl::PointXYZ>::Ptr &source, const Eigen::Matrix4f &truth)
+{
+  AlignResult result;
+  BenchmarkPclNdt ndt;
+  ndt.setTransformationEpsilon(opt.trans_epsilon);
+  ndt.setStepSize(opt.step_size);
+  ndt.setResolution(opt.resolution);
+  ndt.setMaximumIterations(opt.max_iterations);
+
+  pcl::PointCloud<pcl::PointXYZ> output;
+  Clock::time_point start = Clock::now();
+  ndt.setInputTarget(map);
+  ndt.align(output, Eigen::Matrix4f::Identity());
+  result.target_build_ms = elapsedMs(start);
+
+  ndt.setInputSource(source);
+  for (int i = 0; i < opt.repeat; ++i) {
+    start = Clock::now();
+    ndt.align(output, Eigen::Matrix4f::Identity());
+    result.align_ms += elapsedMs(start) / opt.repeat;
+  }
+  result.iterations = ndt.getFinalNumIteration();
+  result.transform_probability = ndt.getTransformationProbability();
+  poseError(ndt.getFinalTransformation(), truth, result);
+
+  // 单次迭代: 一次得分+梯度+Hessian的计算
+  Eigen::Matrix<double, 6, 1> gradient;
+  Eigen::Matrix<double, 6, 6> hessian;
+  start = Clock::now();
+  for (int i = 0; i < opt.repeat; ++i) result.evaluate_score += ndt.evaluate(truth, gradient, hessian) / opt.repeat;
+  result.evaluate_ms = elapsedMs(start) / opt.repeat;
+
+  // 每个点的体素邻域查询
+  size_t hits = 0;
+  start = Clock::now();
+  for (int r = 0; r < opt.repeat; ++r) {
+    for (const auto &p : output.points) hits += ndt.neighbors(p) > 0;
+  }
+  const double queries = std::max<double>(output.size() * opt.repeat, 1);
+  result.neighbor_lookup_ns = elapsedMs(start) * 1e6 / queries;
+  result.neighbor_hit_ratio = hits / queries;
+  return result;
+}
+
+static AlignResult benchmarkCompactNdt(const Options &opt, CompactNdt::Precision precision,
+                                       const pcl::PointCloud<pcl::PointXYZ>::Ptr &map,
+                                       const pcl::PointCloud<pcl::PointXYZ>::Ptr &source, const Eigen::Matrix4f &truth)
+{
+  AlignResult result;
+  CompactNdt ndt;
+  ndt.setTransformationEpsilon(opt.trans_epsilon);
+  ndt.setStepSize(opt.step_size);
+  ndt.setResolution(opt.resolution);
+  ndt.setMaximumIterations(opt.max_iterations);
+  ndt.setPrecision(precision);
+
+  Clock::time_point start = Clock::now();
+  ndt.setInputTarget(*map);
+  result.target_build_ms = elapsedMs(start);
+  result.memory_bytes = ndt.getMemoryFootprint();
+
+  ndt.setInputSource(source);
+  pcl::PointCloud<pcl::PointXYZ> output;
+  for (int i = 0; i < opt.repeat; ++i) {
+    start = Clock::now();
+    ndt.align(output, Eigen::Matrix4f::Identity());
+    result.align_ms += elapsedMs(start) / opt.repeat;
+  }
+  result.iterations = ndt.getFinalNumIteration();
+  result.transform_probability = ndt.getTransformationProbability();
+  poseError(ndt.getFinalTransformation(), truth, result);
+
+  // 单次迭代: 一次得分+梯度+Hessian的计算
+  Eigen::Matrix<double, 6, 1> gradient;
+  Eigen::Matrix<double, 6, 6> hessian;
+  start = Clock::now();
+  for (int i = 0; i < opt.repeat; ++i) result.evaluate_score += ndt.evaluate(truth, gradient, hessian) / opt.repeat;
+  result.evaluate_ms = elapsedMs(start) / opt.repeat;
+
+  // 每个点的体素邻域查询: 与computeDerivatives相同, 所在体素及6个相邻体素
+  const float res = opt.resolution;
+  const Eigen::Vector3f offsets[7] = {Eigen::Vector3f(0, 0, 0), Eigen::Vector3f(res, 0, 0), Eigen::Vector3f(-res, 0, 0),
+                                      Eigen::Vector3f(0, res, 0), Eigen::Vector3f(0, -res, 0),
+                                      Eigen::Vector3f(0, 0, res), Eigen::Vector3f(0, 0, -res)};
+  size_t hits = 0;
+  start = Clock::now();
+  for (int r = 0; r < opt.repeat; ++r) {
+    for (const auto &p : output.points) {
+      int found = 0;
+      for (int n = 0; n < 7; ++n) found += ndt.findVoxel(p.getVector3fMap() + offsets[n]) >= 0;
+      hits += found > 0;
+    }
+  }
+  const double queries = std::max<double>(output.size() * opt.repeat, 1);
+  result.neighbor_lookup_ns = elapsedMs(start) * 1e6 / queries;
+  result.neighbor_hit_ratio = hits / queries;
+  return result;
+}
+
+static std::string alignResultJson(const Options &opt, const AlignResult &r, bool &pass)
+{
+  pass = r.translation_error <= opt.max_translation_error && r.rotation_error <= opt.max_rotation_error;
+  JsonFields fields;
+  fields.push_back(std::make_pair("target_build_ms", jsonNumber(r.target_build_ms)));
+  fields.push_back(std::make_pair("memory_bytes", jsonNumber(r.memory_bytes)));
+  fields.push_back(std::make_pair("align_ms", jsonNumber(r.align_ms)));
+  fields.push_back(std::make_pair("iterations", jsonNumber(r.iterations)));
+  fields.push_back(std::make_pair("per_iteration_ms", jsonNumber(r.align_ms / std::max(r.iterations, 1.0))));
+  fields.push_back(std::make_pair("evaluate_ms", jsonNumber(r.evaluate_ms)));
+  fields.push_back(std::make_pair("evaluate_score", jsonNumber(r.evaluate_score)));
+  fields.push_back(std::make_pair("neighbor_lookup_ns", jsonNumber(r.neighbor_lookup_ns)));
+  fields.push_back(std::make_pair("neighbor_hit_ratio", jsonNumber(r.neighbor_hit_ratio)));
+  fields.push_back(std::make_pair("transform_probability", jsonNumber(r.transform_probability)));
+  fields.push_back(std::make_pair("translation_error", jsonNumber(r.translation_error)));
+  fields.push_back(std::make_pair("rotation_error", jsonNumber(r.rotation_error)));
+  fields.push_back(std::make_pair("pass", pass ? "true" : "false"));
+  return jsonObject(fields, "    ");
+}
+
+//与voxel_grid_filter的scan_callback相同的处理流程, 所有步骤均开启
+static std::string benchmarkDownsampler(const Options &opt, const pcl::PointCloud<pcl::PointXYZ> &map,
+                                        const pcl::PointCloud<pcl::PointXYZ> &scan_sensor,
+                                        const Eigen::Affine3f &map_to_sensor)
+{
+  std::vector<int> point_cells;
+  std::vector<float> cell_min_z;
+  std::vector<uint8_t> point_keep;
+  std::vector<int64_t> static_map_voxels;
+
+  Clock::time_point start = Clock::now();
+  buildStaticMapVoxels(map, opt.static_map_resolution, static_map_voxels);
+  const double static_map_build_ms = elapsedMs(start);
+
+  double range_ms = 0, ground_ms = 0, dynamic_ms = 0, voxel_ms = 0;
+  size_t ground_output = 0, dynamic_output = 0, output_size = 0;
+  for (int i = 0; i < opt.repeat; ++i) {
+    start = Clock::now();
+    pcl::PointCloud<pcl::PointXYZ> scan = removePointsByRange(scan_sensor, 0, MAX_MEASUREMENT_RANGE);
+    range_ms += elapsedMs(start) / opt.repeat;
+
+    start = Clock::now();
+    removeGround(scan, opt.ground_cell_size, opt.ground_height_threshold, opt.ground_max_z, point_cells, cell_min_z);
+    ground_ms += elapsedMs(start) / opt.repeat;
+    ground_output = scan.size();
+
+    start = Clock::now();
+    removeUnmatchedPoints(scan, map_to_sensor, static_map_voxels, opt.static_map_resolution,
+                          opt.dynamic_min_keep_ratio, point_keep);
+    dynamic_ms += elapsedMs(start) / opt.repeat;
+    dynamic_output = scan.size();
+
+    pcl::PointCloud<pcl::PointXYZ>::Ptr scan_ptr(new pcl::PointCloud<pcl::PointXYZ>(scan));
+    pcl::PointCloud<pcl::PointXYZ> filtered;
+    start = Clock::now();
+    voxelGridFilter(scan_ptr, opt.leaf_size, filtered);
+    voxel_ms += elapsedMs(start) / opt.repeat;
+    output_size = filtered.size();
+  }
+  const double total_ms = range_ms + ground_ms + dynamic_ms + voxel_ms;
+
+  JsonFields fields;
+  fields.push_back(std::make_pair("input_points", jsonNumber(scan_sensor.size())));
+  fields.push_back(std::make_pair("after_ground_removal_points", jsonNumber(ground_output)));
+  fields.push_back(std::make_pair("after_dynamic_removal_points", jsonNumber(dynamic_output)));
+  fields.push_back(std::make_pair("output_points", jsonNumber(output_size)));
+  fields.push_back(std::make_pair("static_map_build_ms", jsonNumber(static_map_build_ms)));
+  fields.push_back(std::make_pair("static_map_bytes", jsonNumber(static_map_voxels.size() * sizeof(int64_t))));
+  fields.push_back(std::make_pair("range_filter_ms", jsonNumber(range_ms)));
+  fields.push_back(std::make_pair("ground_removal_ms", jsonNumber(ground_ms)));
+  fields.push_back(std::make_pair("dynamic_removal_ms", jsonNumber(dynamic_ms)));
+  fields.push_back(std::make_pair("voxel_grid_ms", jsonNumber(voxel_ms)));
+  fields.push_back(std::make_pair("total_ms", jsonNumber(total_ms)));
+  fields.push_back(std::make_pair("points_per_second", jsonNumber(scan_sensor.size() / std::max(total_ms / 1000.0, 1e-9))));
+  return jsonObject(fields, "  ");
+}
+
+static bool parseOptions(int argc, char **argv, Options &opt)
+{
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      std::cerr << "missing value for " << arg << std::endl;
+      return false;
+    }
+    const char *value = argv[++i];
+    if (arg == "--map") opt.map_path = value;
+    else if (arg == "--scan") opt.scan_path = value;
+    else if (arg == "--output") opt.output_path = value;
+    else if (arg == "--resolution") opt.resolution = std::atof(value);
+    else if (arg == "--step_size") opt.step_size = std::atof(value);
+    else if (arg == "--trans_epsilon") opt.trans_epsilon = std::atof(value);
+    else if (arg == "--max_iterations") opt.max_iterations = std::atoi(value);
+    else if (arg == "--leaf_size") opt.leaf_size = std::atof(value);
+    else if (arg == "--source_leaf_size") opt.source_leaf_size = std::atof(value);
+    else if (arg == "--ground_cell_size") opt.ground_cell_size = std::atof(value);
+    else if (arg == "--ground_height_threshold") opt.ground_height_threshold = std::atof(value);
+    else if (arg == "--ground_max_z") opt.ground_max_z = std::atof(value);
+    else if (arg == "--static_map_resolution") opt.static_map_resolution = std::atof(value);
+    else if (arg == "--dynamic_min_keep_ratio") opt.dynamic_min_keep_ratio = std::atof(value);
+    else if (arg == "--viewpoint") {
+      float x, y, z;
+      if (std::sscanf(value, "%f,%f,%f", &x, &y, &z) != 3) {
+        std::cerr << "invalid viewpoint " << value << ", expected x,y,z" << std::endl;
+        return false;
+      }
+      opt.viewpoint = Eigen::Vector3f(x, y, z);
+      opt.has_viewpoint = true;
+    }
+    else if (arg == "--repeat") opt.repeat = std::max(1, std::atoi(value));
+    else if (arg == "--max_translation_error") opt.max_translation_error = std::atof(value);
+    else if (arg == "--max_rotation_error") opt.max_rotation_error = std::atof(value);
+    else {
+      std::cerr << "unknown option " << arg << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  Options opt;
+  if (!parseOptions(argc, argv, opt)) return 2;
+
+  pcl::PointCloud<pcl::PointXYZ>::Ptr map(new pcl::PointCloud<pcl::PointXYZ>);
+  if (opt.map_path.empty()) {
+    createSyntheticMap(*map);
+  } else if (pcl::io::loadPCDFile(opt.map_path, *map) == -1) {
+    std::cerr << "load failed " << opt.map_path << std::endl;
+    return 2;
+  }
+
+  // 扫描在map坐标系下, 真值为单位阵; 对其施加已知扰动后从单位阵开始配准
+  const Eigen::Vector3f viewpoint = opt.has_viewpoint ? opt.viewpoint :
+                                    opt.map_path.empty() ? Eigen::Vector3f(0, 0, 1.9f) : defaultViewpoint(*map);
+  pcl::PointCloud<pcl::PointXYZ> scan_map;
+  size_t object_points = 0;
+  if (opt.scan_path.empty()) {
+    object_points = createSensorScan(*map, viewpoint, scan_map);
+  } else if (pcl::io::loadPCDFile(opt.scan_path, scan_map) == -1) {
+    std::cerr << "load failed " << opt.scan_path << std::endl;
+    return 2;
+  }
+  const Eigen::Affine3f truth_affine = Eigen::Translation3f(0.3f, -0.2f, 0.05f) *
+                                       Eigen::AngleAxisf(0.02f, Eigen::Vector3f::UnitZ());
+  const Eigen::Matrix4f truth = truth_affine.matrix();
+  pcl::PointCloud<pcl::PointXYZ>::Ptr source(new pcl::PointCloud<pcl::PointXYZ>);
+  pcl::transformPointCloud(scan_map, *source, Eigen::Matrix4f(truth.inverse()));
+
+  // 降采样在以viewpoint为原点的传感器坐标系下测试
+  const Eigen::Affine3f map_to_sensor(Eigen::Translation3f(viewpoint.x(), viewpoint.y(), viewpoint.z()));
+  pcl::PointCloud<pcl::PointXYZ> scan_sensor;
+  pcl::transformPointCloud(scan_map, scan_sensor, Eigen::Matrix4f(map_to_sensor.inverse().matrix()));
+
+  // 配准输入按source_leaf_size降采样(默认1.0m, 比voxel_grid_filter的默认leaf_size更密)
+  pcl::PointCloud<pcl::PointXYZ>::Ptr filtered_source(new pcl::PointCloud<pcl::PointXYZ>);
+  if (opt.source_leaf_size >= 0.1) {
+    voxelGridFilter(source, opt.source_leaf_size, *filtered_source);
+  } else {
+    *filtered_source = *source;
+  }
+
+  bool pass = true, case_pass = true;
+  JsonFields registration;
+  registration.push_back(std::make_pair("pcl", alignResultJson(opt, benchmarkPclNdt(opt, map, filtered_source, truth), case_pass)));
+  pass &= case_pass;
+  registration.push_back(std::make_pair("compact_float",
+    alignResultJson(opt, benchmarkCompactNdt(opt, CompactNdt::FLOAT, map, filtered_source, truth), case_pass)));
+  pass &= case_pass;
+  registration.push_back(std::make_pair("compact_half",
+    alignResultJson(opt, benchmarkCompactNdt(opt, CompactNdt::HALF, map, filtered_source, truth), case_pass)));
+  pass &= case_pass;
+
+  JsonFields fields;
+  fields.push_back(std::make_pair("map", jsonString(opt.map_path.empty() ? "synthetic" : opt.map_path)));
+  fields.push_back(std::make_pair("scan", jsonString(opt.scan_path.empty() ? "sensor_model" : opt.scan_path)));
+  fields.push_back(std::make_pair("map_points", jsonNumber(map->size())));
+  fields.push_back(std::make_pair("raw_scan_points", jsonNumber(scan_map.size())));
+  fields.push_back(std::make_pair("dynamic_object_points", jsonNumber(object_points)));
+  fields.push_back(std::make_pair("scan_points", jsonNumber(filtered_source->size())));
+  fields.push_back(std::make_pair("resolution", jsonNumber(opt.resolution)));
+  fields.push_back(std::make_pair("step_size", jsonNumber(opt.step_size)));
+  fields.push_back(std::make_pair("leaf_size", jsonNumber(opt.leaf_size)));
+  fields.push_back(std::make_pair("source_leaf_size", jsonNumber(opt.source_leaf_size)));
+  fields.push_back(std::make_pair("repeat", jsonNumber(opt.repeat)));
+  fields.push_back(std::make_pair("downsampler", benchmarkDownsampler(opt, *map, scan_sensor, map_to_sensor)));
+  fields.push_back(std::make_pair("registration", jsonObject(registration, "  ")));
+  fields.push_back(std::make_pair("pass", pass ? "true" : "false"));
+  const std::string json = jsonObject(fields, "") + "\n";
+
+  std::cout << json;
+  if (!opt.output_path.empty()) {
+    std::ofstream ofs(opt.output_path.c_str());
+    ofs << json;
+  }
+  return pass ? 0 : 1;
+}
@@ -2,13 +2,19 @@
 #include <ros/ros.h>
 #include <sensor_msgs/PointCloud2.h>
 
-#include <pcl/point_types.h>
 #include <pcl_conversions/pcl_conversions.h>
-#include <pcl/filters/voxel_grid.h>
 
-// #include "points_downsampler.h"
+#include <geometry_msgs/PoseStamped.h>
+#include <tf2_eigen/tf2_eigen.h>
+#include <tf2_ros/transform_listener.h>
 
-#define MAX_MEASUREMENT_RANGE 120.0
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "ndt_localizer/QueryMap.h"
+
+#include "points_downsampler.h"
 
 ros::Publisher filtered_points_pub;
 
@@ -21,30 +27,155 @@ static std::string filename;
 
 static std::string POINTS_TOPIC;
 
-static pcl::PointCloud<pcl::PointXYZ> removePointsByRange(pcl::PointCloud<pcl::PointXYZ> scan, double min_range, double max_range)
+// 地面去除参数, 基于二维栅格的最低点高度, 点云坐标系下
+static bool remove_ground = false;
+static double ground_cell_size = 1.0;
+static double ground_height_threshold = 0.2;
+static double ground_max_z = -1.0;
+
+// 动态物体去除参数: 与静态地图占据栅格不匹配的点被剔除
+static bool remove_dynamic = false;
+static double static_map_resolution = 1.0;
+static std::string map_frame = "map";
+// 用于估计运动量的两次位姿的时间间隔(s)
+static double motion_dt = 0.1;
+// 安全措施: 位姿比扫描旧超过dynamic_max_pose_age(s), 或剔除后剩余点比例低于dynamic_min_keep_ratio时不做剔除,
+// 避免定位发散或重新初始化后按错误的位姿剔除大部分点, 使ndt无法重新收敛
+static double dynamic_max_pose_age = 0.5;
+static double dynamic_min_keep_ratio = 0.5;
+// ndt_localizer只在收敛时发布ndt_pose, 其时间戳与同一帧的tf相同, 用于判断最新的tf是否来自收敛的结果
+static ros::Time last_converged_stamp;
+static std::vector<int64_t> static_map_voxels;
+static std::mutex static_map_mtx;
+static tf2_ros::Buffer* tf_buffer = nullptr;
+// static_map_query为true时通过query_map服务获取收敛位置周围static_map_radius内按static_map_resolution
+// 降采样的地图, 离上次查询中心超过static_map_update_distance时在后台线程中重新查询
+static bool static_map_query = false;
+static double static_map_radius = 150.0;
+static double static_map_update_distance = 30.0;
+static Eigen::Vector3d static_map_query_position;
+static bool has_static_map_query_position = false;
+
+// 每帧复用的缓冲区, 避免重复分配
+static std::vector<int> point_cells;
+static std::vector<float> cell_min_z;
+static std::vector<uint8_t> point_keep;
+
+//预测扫描时刻map到点云坐标系的位姿: ndt_localizer发布的tf比当前扫描晚一帧,
+//用最近两次位姿之间的运动量按时间线性外推到扫描时刻, 否则高速时整帧会偏出静态地图栅格
+static bool predictMapToSensor(const std::string &sensor_frame, const ros::Time &stamp, Eigen::Affine3d &transform)
 {
-  pcl::PointCloud<pcl::PointXYZ> narrowed_scan;
-  narrowed_scan.header = scan.header;
+  geometry_msgs::TransformStamped latest;
+  try {
+    latest = tf_buffer->lookupTransform(map_frame, sensor_frame, ros::Time(0));
+  } catch (tf2::TransformException &ex) {
+    ROS_WARN_THROTTLE(5, "skip dynamic points removal: %s", ex.what());
+    return false;
+  }
+  transform = tf2::transformToEigen(latest);
 
-  if( min_range>=max_range ) {
-    ROS_ERROR_ONCE("min_range>=max_range @(%lf, %lf)", min_range, max_range );
-    return scan;
+  const ros::Time t1 = latest.header.stamp;
+  if (t1 != last_converged_stamp) {
+    ROS_WARN_THROTTLE(5, "skip dynamic points removal: the latest pose is not converged");
+    return false;
+  }
+  if ((stamp - t1).toSec() > dynamic_max_pose_age) {
+    ROS_WARN_THROTTLE(5, "skip dynamic points removal: the latest pose is %.2fs older than the scan",
+                      (stamp - t1).toSec());
+    return false;
   }
+  if (stamp <= t1 || t1.toSec() <= motion_dt) return true;
 
-  double square_min_range = min_range * min_range;
-  double square_max_range = max_range * max_range;
+  const ros::Time t0 = t1 - ros::Duration(motion_dt);
+  if (!tf_buffer->canTransform(map_frame, sensor_frame, t0)) {
+    ROS_WARN_THROTTLE(5, "no tf history for motion extrapolation, using the latest pose");
+    return true;
+  }
+  const Eigen::Affine3d previous = tf2::transformToEigen(tf_buffer->lookupTransform(map_frame, sensor_frame, t0));
 
-  for(pcl::PointCloud<pcl::PointXYZ>::const_iterator iter = scan.begin(); iter != scan.end(); ++iter)
-  {
-    const pcl::PointXYZ &p = *iter;
-    double square_distance = p.x * p.x + p.y * p.y;
+  // 将两次位姿间的相对运动按(stamp - t1) / (t1 - t0)缩放后叠加到最新位姿上
+  const double ratio = (stamp - t1).toSec() / motion_dt;
+  const Eigen::Affine3d delta = previous.inverse() * transform;
+  const Eigen::AngleAxisd delta_rotation(delta.rotation());
+  const Eigen::Affine3d scaled_delta = Eigen::Translation3d(ratio * delta.translation()) *
+                                       Eigen::AngleAxisd(ratio * delta_rotation.angle(), delta_rotation.axis());
+  transform = transform * scaled_delta;
+  return true;
+}
 
-    if(square_min_range <= square_distance && square_distance <= square_max_range){
-      narrowed_scan.points.push_back(p);
-    }
+//剔除与静态地图不匹配的点, 位姿由predictMapToSensor外推到扫描时刻
+//外推为匀速模型, 急加减速或急转弯时误差仍可能超过一个栅格, 此时应增大static_map_resolution
+static void removeDynamic(pcl::PointCloud<pcl::PointXYZ> &scan, const std::string &sensor_frame, const ros::Time &stamp)
+{
+  std::lock_guard<std::mutex> lock(static_map_mtx);
+  if (static_map_voxels.empty() || tf_buffer == nullptr) return;
+
+  Eigen::Affine3d map_to_sensor;
+  if (!predictMapToSensor(sensor_frame, stamp, map_to_sensor)) return;
+  const Eigen::Affine3f transform = map_to_sensor.cast<float>();
+  if (!removeUnmatchedPoints(scan, transform, static_map_voxels, static_map_resolution, dynamic_min_keep_ratio,
+                             point_keep)) {
+    ROS_WARN_THROTTLE(5, "skip dynamic points removal: less than %.0f%% of the points match the static map",
+                      dynamic_min_keep_ratio * 100);
   }
+}
+
+static void pose_callback(const geometry_msgs::PoseStamped::ConstPtr& pose)
+{
+  last_converged_stamp = pose->header.stamp;
+  std::lock_guard<std::mutex> lock(static_map_mtx);
+  static_map_query_position = Eigen::Vector3d(pose->pose.position.x, pose->pose.position.y, pose->pose.position.z);
+  has_static_map_query_position = true;
+}
+
+//由地图点云生成静态占据栅格, 构建完成后替换旧的栅格
+static void setStaticMap(const sensor_msgs::PointCloud2 &map)
+{
+  std::vector<int64_t> voxels;
+  buildStaticMapVoxels(map, static_map_resolution, voxels);
+  ROS_INFO_STREAM("static map voxels: " << voxels.size() << ", "
+                  << voxels.size() * sizeof(int64_t) / (1024.0 * 1024.0) << " MB");
+  std::lock_guard<std::mutex> lock(static_map_mtx);
+  static_map_voxels.swap(voxels);
+}
+
+static void map_callback(const sensor_msgs::PointCloud2::ConstPtr& input)
+{
+  setStaticMap(*input);
+}
+
+//按收敛的位姿通过query_map服务获取周围的静态地图
+static void static_map_update_loop(ros::ServiceClient client)
+{
+  ros::Rate rate(10);
+  Eigen::Vector3d map_center;
+  bool has_map_center = false;
+  while (ros::ok()) {
+    rate.sleep();
+
+    Eigen::Vector3d position;
+    {
+      std::lock_guard<std::mutex> lock(static_map_mtx);
+      if (!has_static_map_query_position) continue;
+      position = static_map_query_position;
+    }
+    if (has_map_center && (position - map_center).head<2>().norm() < static_map_update_distance) continue;
 
-  return narrowed_scan;
+    // 服务端按栅格大小降采样, 每个占据栅格只需传输一个点
+    ndt_localizer::QueryMap srv;
+    srv.request.center.x = position.x();
+    srv.request.center.y = position.y();
+    srv.request.center.z = position.z();
+    srv.request.radius = static_map_radius;
+    srv.request.resolution = static_map_resolution;
+    if (!client.call(srv)) {
+      ROS_WARN_THROTTLE(5, "query_map failed, retrying");
+      continue;
+    }
+    map_center = position;
+    has_map_center = true;
+    setStaticMap(srv.response.points);
+  }
 }
 
 //得到点云后,首先对点云进行截取,只保留MAX_MEASUREMENT_RANGE距离以内的点用于定位
@@ -53,6 +184,9 @@ static void scan_callback(const sensor_msgs::PointCloud2::ConstPtr& input)
   pcl::PointCloud<pcl::PointXYZ> scan;
   pcl::fromROSMsg(*input, scan);
   scan = removePointsByRange(scan, 0, MAX_MEASUREMENT_RANGE);
+  //去除地面及动态物体上的点, 减少ndt的输入
+  if (remove_ground) removeGround(scan, ground_cell_size, ground_height_threshold, ground_max_z, point_cells, cell_min_z);
+  if (remove_dynamic) removeDynamic(scan, input->header.frame_id, input->header.stamp);
 
   pcl::PointCloud<pcl::PointXYZ>::Ptr scan_ptr(new pcl::PointCloud<pcl::PointXYZ>(scan));//重新赋值给scan_ptr
   pcl::PointCloud<pcl::PointXYZ>::Ptr filtered_scan_ptr(new pcl::PointCloud<pcl::PointXYZ>());
@@ -63,10 +197,7 @@ static void scan_callback(const sensor_msgs::PointCloud2::ConstPtr& input)
   if (voxel_leaf_size >= 0.1)
   {
     // Downsampling the velodyne scan using VoxelGrid filter
-    pcl::VoxelGrid<pcl::PointXYZ> voxel_grid_filter;
-    voxel_grid_filter.setLeafSize(voxel_leaf_size, voxel_leaf_size, voxel_leaf_size);
-    voxel_grid_filter.setInputCloud(scan_ptr);//设置输入点云
-    voxel_grid_filter.filter(*filtered_scan_ptr);//降采样
+    voxelGridFilter(scan_ptr, voxel_leaf_size, *filtered_scan_ptr);//降采样
     pcl::toROSMsg(*filtered_scan_ptr, filtered_msg);//转为ros点云
   }
   else
@@ -79,6 +210,16 @@ static void scan_callback(const sensor_msgs::PointCloud2::ConstPtr& input)
 
 }
 
+//读取正的有限参数, 非法值时使用默认值
+static void positiveParam(ros::NodeHandle &nh, const std::string &name, double &value, double default_value)
+{
+  nh.param<double>(name, value, default_value);
+  if (!(value > 0) || !std::isfinite(value)) {
+    ROS_ERROR_STREAM("invalid " << name << ": " << value << ", use " << default_value);
+    value = default_value;
+  }
+}
+
 int main(int argc, char** argv)
 {
   ros::init(argc, argv, "voxel_grid_filter");
@@ -91,6 +232,26 @@ int main(int argc, char** argv)
 
   private_nh.param<double>("leaf_size", voxel_leaf_size, 2.0);
   ROS_INFO_STREAM("Voxel leaf size is: "<<voxel_leaf_size);
+
+  private_nh.param<bool>("remove_ground", remove_ground, false);
+  positiveParam(private_nh, "ground_cell_size", ground_cell_size, 1.0);
+  private_nh.param<double>("ground_height_threshold", ground_height_threshold, 0.2);
+  private_nh.param<double>("ground_max_z", ground_max_z, -1.0);
+  private_nh.param<bool>("remove_dynamic", remove_dynamic, false);
+  positiveParam(private_nh, "static_map_resolution", static_map_resolution, 1.0);
+  private_nh.param<std::string>("map_frame", map_frame, "map");
+  positiveParam(private_nh, "motion_dt", motion_dt, 0.1);
+  positiveParam(private_nh, "dynamic_max_pose_age", dynamic_max_pose_age, 0.5);
+  private_nh.param<double>("dynamic_min_keep_ratio", dynamic_min_keep_ratio, 0.5);
+  dynamic_min_keep_ratio = std::isfinite(dynamic_min_keep_ratio) ? std::min(std::max(dynamic_min_keep_ratio, 0.0), 1.0) : 0.5;
+  std::string map_topic, pose_topic, map_query_service;
+  private_nh.param<std::string>("map_topic", map_topic, "/points_map");
+  private_nh.param<std::string>("pose_topic", pose_topic, "/ndt_pose");
+  private_nh.param<bool>("static_map_query", static_map_query, false);
+  private_nh.param<std::string>("map_query_service", map_query_service, "/map_loader/query_map");
+  positiveParam(private_nh, "static_map_radius", static_map_radius, 150.0);
+  positiveParam(private_nh, "static_map_update_distance", static_map_update_distance, 30.0);
+  ROS_INFO_STREAM("remove_ground: " << remove_ground << " remove_dynamic: " << remove_dynamic);
   if(_output_log == true){
 	  char buffer[80];
 	  std::time_t now = std::time(NULL);//time_t 这种类型就是用来存储从1970年到现在经过了多少秒
@@ -110,8 +271,26 @@ int main(int argc, char** argv)
 
   // Subscribers
   ros::Subscriber scan_sub = nh.subscribe(POINTS_TOPIC, 10, scan_callback);
+  ros::Subscriber map_sub, pose_sub;
+  // 只有开启动态物体去除时才监听tf
+  std::unique_ptr<tf2_ros::Buffer> buffer;
+  std::unique_ptr<tf2_ros::TransformListener> listener;
+  std::thread map_update_thread;
+  if (remove_dynamic) {
+    buffer.reset(new tf2_ros::Buffer());
+    listener.reset(new tf2_ros::TransformListener(*buffer));
+    tf_buffer = buffer.get();
+    pose_sub = nh.subscribe(pose_topic, 10, pose_callback);
+    if (static_map_query) {
+      map_update_thread = std::thread(static_map_update_loop,
+                                      nh.serviceClient<ndt_localizer::QueryMap>(map_query_service));
+    } else {
+      map_sub = nh.subscribe(map_topic, 1, map_callback);
+    }
+  }
 
   ros::spin();
+  if (map_update_thread.joinable()) map_update_thread.join();
 
   return 0;
 }